@@ -1,9 +1,56 @@
 #include <iostream>
 #include <SDL.h>
+#ifndef BATTLECITY_SERVER
 #include <SDL_image.h>
+#include <SDL_mixer.h>
+#endif
 #include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <cstdlib>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <new>
 #include <algorithm>
-#include <SDL_mixer.h>
+#include <fstream>
+#include <cmath>
+#include <cctype>
+#include <random>
+#ifdef _WIN32
+// winsock2.h has to come before windows.h
+#include <winsock2.h>
+// PSAPI_VERSION 2 resolves GetProcessMemoryInfo from kernel32, no extra link library
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(BATTLECITY_BENCH) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef BATTLECITY_SERVER
+#include <csignal>
+#include <unordered_map>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#endif
+#endif
 
 using namespace std;
 
@@ -13,480 +60,6108 @@ const int TILE_SIZE = 35;
 const int MAP_WIDTH = SCREEN_WIDTH / TILE_SIZE;
 const int MAP_HEIGHT = SCREEN_HEIGHT / TILE_SIZE;
 
-class Bullet {
-public:
-    int x, y;
-    int dx, dy;
-    SDL_Rect rect;
-    bool active;
+// Up, down, left, right; shared by the tank AI and the tile-grid searches
+const int DIRECTIONS[4][2] = {{0,-1}, {0,1}, {-1,0}, {1,0}};
+
+// xorshift32; each enemy owns one so its decisions don't depend on update order
+inline Uint32 nextRandom(Uint32& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// splitmix64 finalizer; spreads a small integer over all 64 bits
+inline Uint64 mix64(Uint64 x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Fletcher-style checksum over whole words: the running sum catches any
+// changed word and the sum of sums catches reordering. Two adds per word keep
+// it far cheaper than a multiplying hash; it only has to notice divergence,
+// not resist deliberate collisions.
+struct WordChecksum {
+    Uint64 sum, sumOfSums;
 
-    Bullet(int startX, int startY, int dirX, int dirY) {
-        x = startX;
-        y = startY;
-        dx = dirX * 2;
-        dy = dirY * 2;
-        active = true;
-        rect = {x, y, 9, 9};
+    WordChecksum() {
+        sum = 0;
+        sumOfSums = 0;
     }
 
-    void move() {
-        x += dx;
-        y += dy;
-        rect.x = x;
-        rect.y = y;
-        if (x < 0 || x > SCREEN_WIDTH || y < 0 || y > SCREEN_HEIGHT) {
-            active = false;
-        }
+    void add(Uint64 value) {
+        sum += value;
+        sumOfSums += sum;
     }
 
-    void render(SDL_Renderer* renderer) {
-        if (active) {
-            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-            SDL_RenderFillRect(renderer, &rect);
-        }
+    Uint64 finish() const {
+        return mix64(sum) ^ mix64(sumOfSums + 1);
+    }
+};
+
+// Playfield size in tiles. The classic map fills the window; stress runs use bigger ones.
+struct MapSize {
+    int width, height;
+
+    MapSize(int w = MAP_WIDTH, int h = MAP_HEIGHT) {
+        width = w;
+        height = h;
+    }
+
+    int tiles() const { return width * height; }
+    int pixelWidth() const { return width * TILE_SIZE; }
+    int pixelHeight() const { return height * TILE_SIZE; }
+
+    // Tile index under the centre of a size x size box at (x, y)
+    int tileIndex(int x, int y, int size) const {
+        int col = (x + size / 2) / TILE_SIZE;
+        int row = (y + size / 2) / TILE_SIZE;
+        col = max(0, min(width - 1, col));
+        row = max(0, min(height - 1, row));
+        return row * width + col;
     }
 };
 
-class Wall {
+#ifdef COUNT_ALLOCATIONS
+// Debug builds count every global operator new to prove the tick loop doesn't
+// allocate. The whole family is replaced, array and aligned forms included, so
+// no allocation gets past the counter and every delete matches its new.
+atomic<size_t> heapAllocations(0);
+
+// Kept out of line: once GCC inlines one side of a new/delete pair it sees
+// malloc or free meet the other operator and warns about a mismatch
+#ifdef __GNUC__
+#define NOINLINE_ALLOCATOR __attribute__((noinline))
+#else
+#define NOINLINE_ALLOCATOR
+#endif
+
+void* countedAlloc(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+NOINLINE_ALLOCATOR void* operator new(size_t size) {
+    void* p = countedAlloc(size);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+NOINLINE_ALLOCATOR void* operator new[](size_t size) {
+    void* p = countedAlloc(size);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+NOINLINE_ALLOCATOR void* operator new(size_t size, const nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+NOINLINE_ALLOCATOR void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+NOINLINE_ALLOCATOR void operator delete(void* p) noexcept {
+    free(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete(void* p, const nothrow_t&) noexcept {
+    free(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete[](void* p, const nothrow_t&) noexcept {
+    free(p);
+}
+
+#ifdef __cpp_aligned_new
+// aligned_alloc wants the size rounded up to the alignment; Windows has its own pair
+void* countedAlignedAlloc(size_t size, align_val_t alignment) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    size_t align = (size_t)alignment;
+    size = (max<size_t>(size, 1) + align - 1) / align * align;
+#ifdef _WIN32
+    return _aligned_malloc(size, align);
+#else
+    return aligned_alloc(align, size);
+#endif
+}
+
+void alignedFree(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+NOINLINE_ALLOCATOR void* operator new(size_t size, align_val_t alignment) {
+    void* p = countedAlignedAlloc(size, alignment);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+NOINLINE_ALLOCATOR void* operator new[](size_t size, align_val_t alignment) {
+    void* p = countedAlignedAlloc(size, alignment);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+NOINLINE_ALLOCATOR void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return countedAlignedAlloc(size, alignment);
+}
+
+NOINLINE_ALLOCATOR void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return countedAlignedAlloc(size, alignment);
+}
+
+NOINLINE_ALLOCATOR void operator delete(void* p, align_val_t) noexcept {
+    alignedFree(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete[](void* p, align_val_t) noexcept {
+    alignedFree(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete(void* p, size_t, align_val_t) noexcept {
+    alignedFree(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete[](void* p, size_t, align_val_t) noexcept {
+    alignedFree(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete(void* p, align_val_t, const nothrow_t&) noexcept {
+    alignedFree(p);
+}
+
+NOINLINE_ALLOCATOR void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept {
+    alignedFree(p);
+}
+#endif
+#endif
+
+// Bump allocator for data that only lives for one tick. Game resets it at the
+// end of update(); blocks are kept, so after the first few ticks nothing here
+// reaches malloc.
+class FrameArena {
 public:
-    int x, y;
-    SDL_Rect rect;
-    bool active;
+    vector<vector<Uint8>> blocks;
+    size_t block;
+    size_t offset;
+    size_t allocations;
+    size_t bytesUsed;
+    size_t peakBytes;
 
-    Wall(int startX, int startY) {
-        x = startX;
-        y = startY;
-        active = true;
-        rect = {x, y, TILE_SIZE, TILE_SIZE};
+    FrameArena(size_t blockSize = 1 << 18) {
+        blocks.emplace_back(blockSize);
+        block = 0;
+        offset = 0;
+        allocations = 0;
+        bytesUsed = 0;
+        peakBytes = 0;
     }
 
-    void render(SDL_Renderer* renderer, SDL_Texture* texture) {
-        if (active) {
-            SDL_RenderCopy(renderer, texture, NULL, &rect);
+    void* allocate(size_t bytes, size_t align) {
+        size_t start = (offset + align - 1) & ~(align - 1);
+        if (start + bytes > blocks[block].size()) {
+            block++;
+            if (block == blocks.size()) {
+                blocks.emplace_back(max(bytes + align, blocks[0].size()));
+            }
+            start = 0;
         }
+        offset = start + bytes;
+        allocations++;
+        bytesUsed += bytes;
+        return blocks[block].data() + start;
+    }
+
+    void reset() {
+        peakBytes = max(peakBytes, bytesUsed);
+        block = 0;
+        offset = 0;
+        allocations = 0;
+        bytesUsed = 0;
     }
 };
 
-class PlayerTank {
+// STL adapter: containers built on it free nothing themselves, the arena reset does
+template<class T>
+class ArenaAllocator {
 public:
-    int x, y;
-    int dirX, dirY;
-    SDL_Rect rect;
-    vector<Bullet> bullets;
+    typedef T value_type;
+    FrameArena* arena;
+
+    ArenaAllocator(FrameArena& frameArena) : arena(&frameArena) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
 
-    PlayerTank(int startX, int startY) {
-        x = startX;
-        y = startY;
-        rect = {x, y, TILE_SIZE, TILE_SIZE};
-        dirX = 0;
-        dirY = -1;
+    T* allocate(size_t n) {
+        return (T*)arena->allocate(n * sizeof(T), alignof(T));
     }
 
-    void move(int dx, int dy, const vector<Wall>& walls) {
-        int newX = x + dx;
-        int newY = y + dy;
-        dirX = dx;
-        dirY = dy;
+    void deallocate(T*, size_t) {}
 
-        SDL_Rect newRect = {newX, newY, TILE_SIZE, TILE_SIZE};
-        for (const auto& wall : walls) {
-            if (wall.active && SDL_HasIntersection(&newRect, &wall.rect)) {
-                return;
-            }
-        }
+    template<class U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena != other.arena;
+    }
+};
+
+template<class T>
+using FrameVector = vector<T, ArenaAllocator<T>>;
+
+// Stable reference to an entity in a SlotMap; stale once the entity is removed
+struct SlotHandle {
+    Uint32 index;
+    Uint32 generation;
+};
+
+// Generational slot map over a component store: entities stay packed in the
+// store's arrays for linear iteration, removal swaps the last entity into the
+// hole, and handles go through a slot table so they survive that move and
+// detect reuse of a freed slot. Store provides size(), add(), moveRow(),
+// popRow(), clear() and reserve(); entities only come in through insert().
+template<class Store>
+class SlotMap : public Store {
+public:
+    struct Slot {
+        Uint32 dense;
+        Uint32 generation;
+    };
+
+    vector<Uint32> denseToSlot;
+    vector<Slot> slots;
+    vector<Uint32> freeSlots;
+
+    bool empty() const { return this->size() == 0; }
+
+    void reserve(size_t n) {
+        Store::reserve(n);
+        denseToSlot.reserve(n);
+        slots.reserve(n);
+        freeSlots.reserve(n);
+    }
 
-        if (newX >= TILE_SIZE && newX <= SCREEN_WIDTH - TILE_SIZE * 2 &&
-            newY >= TILE_SIZE && newY <= SCREEN_HEIGHT - TILE_SIZE * 2) {
-            x = newX;
-            y = newY;
-            rect.x = x;
-            rect.y = y;
+    template<class... Args>
+    SlotHandle insert(const Args&... args) {
+        Uint32 slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = (Uint32)slots.size();
+            slots.push_back({0, 0});
         }
+        slots[slot].dense = (Uint32)this->size();
+        Store::add(args...);
+        denseToSlot.push_back(slot);
+        return {slot, slots[slot].generation};
+    }
+
+    SlotHandle handleAt(int i) const {
+        Uint32 slot = denseToSlot[i];
+        return {slot, slots[slot].generation};
     }
 
-    void shoot() {
-        bullets.emplace_back(x + TILE_SIZE/2 - 5, y + TILE_SIZE/2 - 5, dirX, dirY);
+    // Dense index of the entity, or -1 once it has been removed
+    int get(SlotHandle handle) const {
+        if (handle.index >= slots.size() || slots[handle.index].generation != handle.generation) return -1;
+        return (int)slots[handle.index].dense;
     }
 
-    void updateBullets() {
-        bullets.erase(remove_if(bullets.begin(), bullets.end(),
-            [](Bullet& b) { return !b.active; }), bullets.end());
-        for (auto& bullet : bullets) {
-            bullet.move();
+    void removeAt(int i) {
+        Uint32 slot = denseToSlot[i];
+        int last = this->size() - 1;
+        if (i != last) {
+            Store::moveRow(i, last);
+            denseToSlot[i] = denseToSlot[last];
+            slots[denseToSlot[i]].dense = (Uint32)i;
         }
+        Store::popRow();
+        denseToSlot.pop_back();
+        slots[slot].generation++;
+        freeSlots.push_back(slot);
     }
 
-    void render(SDL_Renderer* renderer) {
-        SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-        SDL_RenderFillRect(renderer, &rect);
-        for (auto& bullet : bullets) {
-            bullet.render(renderer);
+    bool remove(SlotHandle handle) {
+        int i = get(handle);
+        if (i < 0) return false;
+        removeAt(i);
+        return true;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < denseToSlot.size(); i++) {
+            slots[denseToSlot[i]].generation++;
+            freeSlots.push_back(denseToSlot[i]);
         }
+        Store::clear();
+        denseToSlot.clear();
     }
 };
 
-class EnemyTank {
+const int BULLET_SIZE = 9;
+
+enum Team {
+    TEAM_PLAYER,
+    TEAM_ENEMY
+};
+
+// Every bullet in the match, both teams, as parallel component arrays.
+// Systems below walk them linearly; index i is one bullet across all arrays.
+class BulletStore {
 public:
-    int x, y;
-    int dirX, dirY;
-    int moveDelay, shootDelay;
-    SDL_Rect rect;
-    bool active;
-    vector<Bullet> bullets;
+    vector<int> x, y;
+    vector<int> dx, dy;
+    vector<Uint8> team;
+    // Lifetime: cleared when the bullet leaves the screen or hits something
+    vector<Uint8> active;
+    vector<int> obsCell;
+    // Serial number per bullet, so network snapshots can match bullets across ticks
+    vector<Uint32> id;
+    Uint32 nextId;
 
-    EnemyTank(int startX, int startY) {
-        moveDelay = 20;
-        shootDelay = 70;
-        x = startX;
-        y = startY;
-        rect = {x, y, TILE_SIZE, TILE_SIZE};
-        dirX = 0;
-        dirY = 1;
-        active = true;
+    BulletStore() {
+        nextId = 0;
     }
 
-    void move(const vector<Wall>& walls) {
-        if (--moveDelay > 0) return;
-        moveDelay = 15;
+    int size() const {
+        return (int)x.size();
+    }
 
-        int directions[4][2] = {{0,-5}, {0,5}, {-5,0}, {5,0}};
-        int r = rand() % 4;
-        dirX = directions[r][0];
-        dirY = directions[r][1];
+    void reserve(int n) {
+        x.reserve(n);
+        y.reserve(n);
+        dx.reserve(n);
+        dy.reserve(n);
+        team.reserve(n);
+        active.reserve(n);
+        obsCell.reserve(n);
+        id.reserve(n);
+    }
 
-        int newX = x + dirX;
-        int newY = y + dirY;
+    void spawn(int startX, int startY, int dirX, int dirY, Team owner) {
+        x.push_back(startX);
+        y.push_back(startY);
+        dx.push_back(dirX * 2);
+        dy.push_back(dirY * 2);
+        team.push_back((Uint8)owner);
+        active.push_back(1);
+        obsCell.push_back(-1);
+        id.push_back(++nextId);
+    }
 
-        SDL_Rect newRect = {newX, newY, TILE_SIZE, TILE_SIZE};
-        for (const auto& wall : walls) {
-            if (wall.active && SDL_HasIntersection(&newRect, &wall.rect)) {
-                return;
-            }
+    SDL_Rect rect(int i) const {
+        return {x[i], y[i], BULLET_SIZE, BULLET_SIZE};
+    }
+
+    void move(const MapSize& map) {
+        int n = size();
+        int maxX = map.pixelWidth(), maxY = map.pixelHeight();
+        for (int i = 0; i < n; i++) {
+            x[i] += dx[i];
+            y[i] += dy[i];
         }
-        if (newX >= TILE_SIZE && newX <= SCREEN_WIDTH - TILE_SIZE * 2 &&
-            newY >= TILE_SIZE && newY <= SCREEN_HEIGHT - TILE_SIZE * 2) {
-            x = newX;
-            y = newY;
-            rect.x = x;
-            rect.y = y;
+        for (int i = 0; i < n; i++) {
+            if (x[i] < 0 || x[i] > maxX || y[i] < 0 || y[i] > maxY) {
+                active[i] = 0;
+            }
         }
     }
 
-    void shoot() {
-        bullets.emplace_back(x + TILE_SIZE/5 - 5, y + TILE_SIZE/5 - 5, dirX, dirY);
+    // Drops dead bullets, keeping the survivors in order
+    void compact() {
+        int n = size(), kept = 0;
+        for (int i = 0; i < n; i++) {
+            if (!active[i]) continue;
+            if (kept != i) {
+                x[kept] = x[i];
+                y[kept] = y[i];
+                dx[kept] = dx[i];
+                dy[kept] = dy[i];
+                team[kept] = team[i];
+                active[kept] = 1;
+                obsCell[kept] = obsCell[i];
+                id[kept] = id[i];
+            }
+            kept++;
+        }
+        x.resize(kept);
+        y.resize(kept);
+        dx.resize(kept);
+        dy.resize(kept);
+        team.resize(kept);
+        active.resize(kept);
+        obsCell.resize(kept);
+        id.resize(kept);
     }
 
-    void updateBullets() {
-        bullets.erase(remove_if(bullets.begin(), bullets.end(),
-            [](Bullet& b) { return !b.active; }), bullets.end());
-        for (auto& bullet : bullets) {
-            bullet.move();
-        }
+    void clear() {
+        x.clear();
+        y.clear();
+        dx.clear();
+        dy.clear();
+        team.clear();
+        active.clear();
+        obsCell.clear();
+        id.clear();
     }
 
-    void render(SDL_Renderer* renderer) {
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-        SDL_RenderFillRect(renderer, &rect);
-        for (auto& bullet : bullets) {
-            bullet.render(renderer);
+    // One batched draw call for every live bullet
+    void appendRects(vector<SDL_Rect>& rects) const {
+        int n = size();
+        for (int i = 0; i < n; i++) {
+            if (active[i]) rects.push_back(rect(i));
         }
     }
 };
 
-class Menu {
+// Every wall in the match as parallel component arrays. Walls never move,
+// so the one-tile collider is also their position.
+class WallStore {
 public:
-    SDL_Texture* playTexture;
-    SDL_Texture* exitTexture;
-    SDL_Texture* backgroundTexture;
-    Mix_Music* backgroundMusic;
-    SDL_Rect playButton;
-    SDL_Rect exitButton;
-    bool showMenu;
+    vector<SDL_Rect> rect;
+    // Lifetime: cleared when a player's bullet destroys the wall
+    vector<Uint8> active;
 
-    Menu(SDL_Renderer* renderer) {
-        backgroundMusic = Mix_LoadMUS("nhacnen.wav");
-        if (!backgroundMusic) {
-            cerr << "Failed to load menu music: " << Mix_GetError() << endl;
-        } else {
-            Mix_VolumeMusic(64);
-            Mix_PlayMusic(backgroundMusic, -1);
-        }
+    int size() const {
+        return (int)rect.size();
+    }
 
-        backgroundTexture = IMG_LoadTexture(renderer, "backgroundmenu.png");
-        playTexture = IMG_LoadTexture(renderer, "play.png");
-        exitTexture = IMG_LoadTexture(renderer, "exit.png");
+    void reserve(int n) {
+        rect.reserve(n);
+        active.reserve(n);
+    }
 
-        playButton = {SCREEN_WIDTH/2 - 100, 300, 200, 80};
-        exitButton = {SCREEN_WIDTH/2 - 100, 400, 200, 80};
-        showMenu = true;
+    void add(int x, int y) {
+        rect.push_back({x, y, TILE_SIZE, TILE_SIZE});
+        active.push_back(1);
     }
 
-    void handleEvents(SDL_Event& e) {
-        if (e.type == SDL_MOUSEBUTTONDOWN) {
-            int x, y;
-            SDL_GetMouseState(&x, &y);
-            SDL_Point mousePos = {x, y};
+    void clear() {
+        rect.clear();
+        active.clear();
+    }
+};
 
-            if (SDL_PointInRect(&mousePos, &playButton)) {
-                showMenu = false;
-            }
-            if (SDL_PointInRect(&mousePos, &exitButton)) {
-                exit(0);
-            }
+// Shared by both tank types: inside the arena and clear of every active wall
+bool canOccupy(const SDL_Rect& r, const WallStore& walls, const MapSize& map) {
+    if (r.x < TILE_SIZE || r.x > (map.width - 2) * TILE_SIZE ||
+        r.y < TILE_SIZE || r.y > (map.height - 2) * TILE_SIZE) {
+        return false;
+    }
+    int n = walls.size();
+    for (int w = 0; w < n; w++) {
+        if (walls.active[w] && SDL_HasIntersection(&r, &walls.rect[w])) {
+            return false;
         }
     }
+    return true;
+}
 
-    void render(SDL_Renderer* renderer) {
-        if (backgroundTexture) {
-            SDL_RenderCopy(renderer, backgroundTexture, NULL, NULL);
-        } else {
-            SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
-            SDL_RenderClear(renderer);
-        }
+// Position, facing, collider and lifetime of every tank of one kind as
+// parallel component arrays; index i is one tank across all of them. Players
+// and enemies each have a store and share the movement rule; each kind only
+// decides where it wants to go.
+class TankStore {
+public:
+    vector<int> x, y;
+    // Facing, scaled by the last step taken along it
+    vector<int> dirX, dirY;
+    vector<SDL_Rect> rect;
+    // Lifetime: cleared when the tank is hit, or while a network slot is empty
+    vector<Uint8> active;
+    vector<int> obsCell;
 
-        if (playTexture) SDL_RenderCopy(renderer, playTexture, NULL, &playButton);
-        if (exitTexture) SDL_RenderCopy(renderer, exitTexture, NULL, &exitButton);
+    int size() const {
+        return (int)x.size();
+    }
 
-        SDL_RenderPresent(renderer);
+    void reserve(int n) {
+        x.reserve(n);
+        y.reserve(n);
+        dirX.reserve(n);
+        dirY.reserve(n);
+        rect.reserve(n);
+        active.reserve(n);
+        obsCell.reserve(n);
     }
 
-    ~Menu() {
-        SDL_DestroyTexture(backgroundTexture);
-        SDL_DestroyTexture(playTexture);
-        SDL_DestroyTexture(exitTexture);
-        if (backgroundMusic) {
-            Mix_HaltMusic();
-            Mix_FreeMusic(backgroundMusic);
-        }
+    void add(int startX, int startY, int facingY) {
+        x.push_back(startX);
+        y.push_back(startY);
+        dirX.push_back(0);
+        dirY.push_back(facingY);
+        rect.push_back({startX, startY, TILE_SIZE, TILE_SIZE});
+        active.push_back(1);
+        obsCell.push_back(-1);
+    }
+
+    void place(int i, int newX, int newY) {
+        x[i] = newX;
+        y[i] = newY;
+        rect[i].x = newX;
+        rect[i].y = newY;
+    }
+
+    static bool canMoveTo(int newX, int newY, const WallStore& walls, const MapSize& map) {
+        SDL_Rect newRect = {newX, newY, TILE_SIZE, TILE_SIZE};
+        return canOccupy(newRect, walls, map);
+    }
+
+    // Turns tank i to face the step and takes it if nothing is in the way
+    void move(int i, int dx, int dy, const WallStore& walls, const MapSize& map) {
+        dirX[i] = dx;
+        dirY[i] = dy;
+        if (canMoveTo(x[i] + dx, y[i] + dy, walls, map)) place(i, x[i] + dx, y[i] + dy);
+    }
+
+    // Copies tank from over tank to; SlotMap uses it to fill the hole a removal leaves
+    void moveRow(int to, int from) {
+        x[to] = x[from];
+        y[to] = y[from];
+        dirX[to] = dirX[from];
+        dirY[to] = dirY[from];
+        rect[to] = rect[from];
+        active[to] = active[from];
+        obsCell[to] = obsCell[from];
+    }
+
+    void popRow() {
+        x.pop_back();
+        y.pop_back();
+        dirX.pop_back();
+        dirY.pop_back();
+        rect.pop_back();
+        active.pop_back();
+        obsCell.pop_back();
+    }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        dirX.clear();
+        dirY.clear();
+        rect.clear();
+        active.clear();
+        obsCell.clear();
     }
 };
 
-class Game {
+// Wall-free spawn tiles as a dense list plus each tile's index in it, so a
+// tile opens or closes in O(1) and a uniform pick is a single random draw.
+class FreeTiles {
 public:
-    SDL_Window* window;
-    SDL_Renderer* renderer;
-    SDL_Texture* wallTexture;
-    SDL_Texture* winTexture;
-    SDL_Texture* gameOverTexture;
-    Mix_Chunk* playerShootSound;
-    Mix_Chunk* enemyShootSound;
-    Mix_Music* backgroundMusic;
+    vector<int> tiles;
+    // Per map cell: position in tiles, or -1 when the cell isn't free
+    vector<int> slot;
 
-    bool isGameOver;
-    bool running;
-    bool isVictory;
-    vector<Wall> walls;
-    PlayerTank player;
-    int enemyNumber;
-    vector<EnemyTank> enemies;
-    Uint32 endTime;
+    void reset(int cellCount) {
+        tiles.clear();
+        slot.assign(cellCount, -1);
+    }
 
-    Game() : player(((MAP_WIDTH-1)/2)*TILE_SIZE, (MAP_HEIGHT-2)*TILE_SIZE) {
-        running = true;
-        isGameOver = false;
-        isVictory = false;
-        enemyNumber = 5;
-        endTime = 0;
+    int size() const {
+        return (int)tiles.size();
+    }
 
-        SDL_Init(SDL_INIT_VIDEO);
-        IMG_Init(IMG_INIT_PNG);
+    bool contains(int cell) const {
+        return slot[cell] >= 0;
+    }
 
-        window = SDL_CreateWindow("Battle City", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                                 SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    void add(int cell) {
+        if (slot[cell] >= 0) return;
+        slot[cell] = (int)tiles.size();
+        tiles.push_back(cell);
+    }
 
-        Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
-        backgroundMusic = Mix_LoadMUS("nhacnen.wav");
-        Mix_PlayMusic(backgroundMusic, -1);
+    void remove(int cell) {
+        int i = slot[cell];
+        if (i < 0) return;
+        int last = tiles.back();
+        tiles[i] = last;
+        slot[last] = i;
+        tiles.pop_back();
+        slot[cell] = -1;
+    }
+};
 
-        playerShootSound = Mix_LoadWAV("music.wav");
-        enemyShootSound = Mix_LoadWAV("music.wav");
-        Mix_VolumeChunk(playerShootSound, 10);
-        Mix_VolumeChunk(enemyShootSound, 10);
+// BFS distance field towards one target tile, shared by every enemy.
+// Rebuilt when the target changes tile; when a tile opens or closes only the
+// region whose distances change is repaired, the same idea as LPA*/D* Lite
+// applied to a field that serves every start tile at once.
+class FlowField {
+public:
+    int width, height;
+    vector<Uint8> blocked;
+    vector<int> distance;
+    vector<Sint8> next;
+    vector<int> queue;
+    vector<int> affected;
+    int target;
 
-        wallTexture = IMG_LoadTexture(renderer, "wall.png");
-        winTexture = IMG_LoadTexture(renderer, "win.png");
-        gameOverTexture = IMG_LoadTexture(renderer, "gameover.png");
+    FlowField(int w = MAP_WIDTH, int h = MAP_HEIGHT) {
+        resize(w, h);
+    }
 
-        generateWalls();
-        spawnEnemies();
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        blocked.assign(width * height, 0);
+        distance.assign(width * height, INT_MAX);
+        next.assign(width * height, -1);
+        queue.reserve(width * height);
+        affected.reserve(width * height);
+        target = -1;
     }
 
-    void generateWalls() {
-        for (int i = 2; i < MAP_HEIGHT - 1; i += 3) {
-            for (int j = 2; j < MAP_WIDTH - 1; j += 3) {
-                walls.emplace_back(j * TILE_SIZE, i * TILE_SIZE);
+    // The outer ring of tiles is off limits to tanks, as are active walls
+    void build(const WallStore& walls) {
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                bool border = row == 0 || col == 0 || row == height - 1 || col == width - 1;
+                blocked[row * width + col] = border ? 1 : 0;
             }
         }
+        for (int w = 0; w < walls.size(); w++) {
+            if (walls.active[w]) blocked[(walls.rect[w].y / TILE_SIZE) * width + walls.rect[w].x / TILE_SIZE] = 1;
+        }
+        if (target >= 0) recompute();
     }
 
-    void spawnEnemies() {
-        enemies.clear();
-        for (int i = 0; i < enemyNumber; i++) {
-            bool valid = false;
-            int x, y;
-            while (!valid) {
-                x = (rand() % (MAP_WIDTH - 4) + 2) * TILE_SIZE;
-                y = (rand() % (MAP_HEIGHT - 4) + 2) * TILE_SIZE;
-                valid = true;
-
-                SDL_Rect tempRect = {x, y, TILE_SIZE, TILE_SIZE};
-                for (const auto& wall : walls) {
-                    if (wall.active && SDL_HasIntersection(&tempRect, &wall.rect)) {
-                        valid = false;
-                        break;
-                    }
-                }
-                if (SDL_HasIntersection(&tempRect, &player.rect)) {
-                    valid = false;
-                }
-            }
-            enemies.emplace_back(x, y);
-        }
+    void setTarget(int cell) {
+        if (cell == target) return;
+        target = cell;
+        recompute();
     }
 
-    void handleEvents() {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            if (event.type == SDL_QUIT) {
-                running = false;
-            }
-            else if (event.type == SDL_KEYDOWN) {
-                switch (event.key.keysym.sym) {
-                    case SDLK_UP: player.move(0, -5, walls); break;
-                    case SDLK_DOWN: player.move(0, 5, walls); break;
-                    case SDLK_LEFT: player.move(-5, 0, walls); break;
-                    case SDLK_RIGHT: player.move(5, 0, walls); break;
-                    case SDLK_SPACE:
-                        player.shoot();
-                        Mix_PlayChannel(-1, playerShootSound, 0);
-                        break;
-                }
-            }
-        }
+    void recompute() {
+        fill(distance.begin(), distance.end(), INT_MAX);
+        fill(next.begin(), next.end(), -1);
+        queue.clear();
+        if (blocked[target]) return;
+        distance[target] = 0;
+        queue.push_back(target);
+        relax(0);
     }
 
-    void update() {
-        player.updateBullets();
+    int neighbour(int cell, int d) const {
+        int nc = cell % width + DIRECTIONS[d][0];
+        int nr = cell / width + DIRECTIONS[d][1];
+        if (nc < 0 || nr < 0 || nc >= width || nr >= height) return -1;
+        return nr * width + nc;
+    }
 
-        // Update enemies
-        for (auto& enemy : enemies) {
-            if (enemy.active) {
-                enemy.move(walls);
-                enemy.updateBullets();
-                if (rand() % 100 < 2) {
-                    enemy.shoot();
-                    Mix_PlayChannel(-1, enemyShootSound, 0);
-                }
+    // Best distance a tile can take from its neighbours, written into distance/next
+    bool seed(int cell) {
+        for (int d = 0; d < 4; d++) {
+            int n = neighbour(cell, d);
+            if (n < 0 || distance[n] == INT_MAX) continue;
+            if (distance[n] + 1 < distance[cell]) {
+                distance[cell] = distance[n] + 1;
+                next[cell] = d;
             }
         }
+        return distance[cell] != INT_MAX;
+    }
 
-        // Check collisions
-        for (auto& bullet : player.bullets) {
-            for (auto& wall : walls) {
-                if (wall.active && SDL_HasIntersection(&bullet.rect, &wall.rect)) {
-                    wall.active = false;
-                    bullet.active = false;
-                }
-            }
-            for (auto& enemy : enemies) {
-                if (enemy.active && SDL_HasIntersection(&bullet.rect, &enemy.rect)) {
-                    enemy.active = false;
-                    bullet.active = false;
-                }
+    // Wall destroyed: the tile can only shorten paths, so propagate from it alone
+    void openCell(int cell) {
+        if (!blocked[cell]) return;
+        blocked[cell] = 0;
+        if (target < 0) return;
+        if (cell == target) {
+            recompute();
+            return;
+        }
+        queue.clear();
+        if (!seed(cell)) return;
+        queue.push_back(cell);
+        relax(0);
+    }
+
+    // Wall placed: only tiles whose route ran through it lose their distance,
+    // then that region is refilled from its intact border
+    void closeCell(int cell) {
+        if (blocked[cell]) return;
+        blocked[cell] = 1;
+        if (target < 0 || distance[cell] == INT_MAX) return;
+        if (cell == target) {
+            recompute();
+            return;
+        }
+        affected.clear();
+        affected.push_back(cell);
+        distance[cell] = INT_MAX;
+        next[cell] = -1;
+        for (size_t i = 0; i < affected.size(); i++) {
+            int parent = affected[i];
+            for (int d = 0; d < 4; d++) {
+                int n = neighbour(parent, d);
+                if (n < 0 || distance[n] == INT_MAX || next[n] != (d ^ 1)) continue;
+                distance[n] = INT_MAX;
+                next[n] = -1;
+                affected.push_back(n);
             }
         }
+        queue.clear();
+        for (size_t i = 1; i < affected.size(); i++) {
+            if (seed(affected[i])) queue.push_back(affected[i]);
+        }
+        sort(queue.begin(), queue.end(), [this](int a, int b) { return distance[a] < distance[b]; });
+        relax(0);
+    }
 
-        // Check player hit
-        for (auto& enemy : enemies) {
-            for (auto& bullet : enemy.bullets) {
-                if (SDL_HasIntersection(&bullet.rect, &player.rect)) {
-                    isGameOver = true;
-                    running = false;
-                    endTime = SDL_GetTicks();
-                }
+    // Label-correcting BFS: a tile is queued again whenever its distance drops
+    void relax(size_t head) {
+        while (head < queue.size()) {
+            int cell = queue[head++];
+            for (int d = 0; d < 4; d++) {
+                int n = neighbour(cell, d);
+                if (n < 0 || blocked[n] || distance[n] <= distance[cell] + 1) continue;
+                distance[n] = distance[cell] + 1;
+                // Neighbour n reaches the target by stepping back opposite to d
+                next[n] = d ^ 1;
+                queue.push_back(n);
             }
         }
+    }
+
+    // Direction index into DIRECTIONS, or -1 at the target or with no route
+    int direction(int cell) const {
+        return next[cell];
+    }
+
+    // DDA walk over the tile grid from pixel (x0, y0) to (x1, y1); false if a
+    // blocked tile lies strictly between the two end tiles
+    bool lineOfSight(int x0, int y0, int x1, int y1) const {
+        int col = x0 / TILE_SIZE, row = y0 / TILE_SIZE;
+        int endCol = x1 / TILE_SIZE, endRow = y1 / TILE_SIZE;
+        int dx = x1 - x0, dy = y1 - y0;
+        int stepX = dx > 0 ? 1 : -1;
+        int stepY = dy > 0 ? 1 : -1;
+        // Ray parameter at the next column/row boundary, and per whole tile
+        double tMaxX = dx > 0 ? ((col + 1) * TILE_SIZE - x0) / (double)dx
+                     : dx < 0 ? (col * TILE_SIZE - x0) / (double)dx : 1e30;
+        double tMaxY = dy > 0 ? ((row + 1) * TILE_SIZE - y0) / (double)dy
+                     : dy < 0 ? (row * TILE_SIZE - y0) / (double)dy : 1e30;
+        double tDeltaX = dx != 0 ? (double)TILE_SIZE / abs(dx) : 1e30;
+        double tDeltaY = dy != 0 ? (double)TILE_SIZE / abs(dy) : 1e30;
+        for (int steps = width + height; steps > 0; steps--) {
+            if (col == endCol && row == endRow) return true;
+            if (tMaxX < tMaxY) {
+                col += stepX;
+                tMaxX += tDeltaX;
+            } else {
+                row += stepY;
+                tMaxY += tDeltaY;
+            }
+            if (col < 0 || row < 0 || col >= width || row >= height) return false;
+            if (col == endCol && row == endRow) return true;
+            if (blocked[row * width + col]) return false;
+        }
+        return false;
+    }
+
+    // Like lineOfSight, but the end tile has to be open as well
+    bool pathClear(int x0, int y0, int x1, int y1) const {
+        return lineOfSight(x0, y0, x1, y1) && !blocked[(y1 / TILE_SIZE) * width + x1 / TILE_SIZE];
+    }
+};
+
+// AI state of one enemy tank; its body lives in the TankStore arrays
+struct EnemyBrain {
+    int moveDelay, shootDelay;
+    Uint32 rng;
+    int nextX, nextY;
+    bool wantsShoot;
+    int heading;
+    bool thinkNow;
+    Uint32 nextThink;
+    int thinkInterval;
+    int fireCooldown;
+};
+
+// Enemy tanks: the shared tank components plus one EnemyBrain each. Game
+// keeps it in a SlotMap, so handles stay valid while enemies are removed.
+class EnemyStore : public TankStore {
+public:
+    vector<EnemyBrain> brain;
+    // Serial number per enemy, so network snapshots can match enemies across ticks
+    vector<Uint32> serial;
+    Uint32 nextSerial;
+
+    EnemyStore() {
+        nextSerial = 0;
+    }
+
+    void reserve(int n) {
+        TankStore::reserve(n);
+        brain.reserve(n);
+        serial.reserve(n);
+    }
+
+    void add(int startX, int startY) {
+        TankStore::add(startX, startY, 1);
+        EnemyBrain fresh = {20, 70, 1, startX, startY, false, 1, true, 0, 1, 70};
+        brain.push_back(fresh);
+        serial.push_back(++nextSerial);
+    }
+
+    void moveRow(int to, int from) {
+        TankStore::moveRow(to, from);
+        brain[to] = brain[from];
+        serial[to] = serial[from];
+    }
+
+    void popRow() {
+        TankStore::popRow();
+        brain.pop_back();
+        serial.pop_back();
+    }
+
+    void clear() {
+        TankStore::clear();
+        brain.clear();
+        serial.clear();
+    }
+
+    // Where shoot() puts tank i's bullet
+    SDL_Rect muzzle(int i) const {
+        return {x[i] + TILE_SIZE / 5 - 5, y[i] + TILE_SIZE / 5 - 5, BULLET_SIZE, BULLET_SIZE};
+    }
+
+    // Fires only when the bullet's swept footprint reaches the target with no
+    // wall in between. The lane test rejects almost every tank before any
+    // raycast is done; walls are whole tiles, so clear paths along both edges
+    // of the lane, up to where the bullet first touches the target, mean the
+    // bullet gets through.
+    bool canHit(int i, const SDL_Rect& target, const FlowField& flow) const {
+        SDL_Rect shot = muzzle(i);
+        int last = BULLET_SIZE - 1;
+        if (dirX[i] != 0) {
+            if (target.y > shot.y + last || target.y + target.h <= shot.y) return false;
+            if (dirX[i] > 0 ? target.x + target.w <= shot.x : target.x > shot.x + last) return false;
+            int from = dirX[i] > 0 ? shot.x + last : shot.x;
+            int to = dirX[i] > 0 ? max(from, target.x) : min(from, target.x + target.w - 1);
+            return flow.pathClear(from, shot.y, to, shot.y) &&
+                   flow.pathClear(from, shot.y + last, to, shot.y + last);
+        }
+        if (target.x > shot.x + last || target.x + target.w <= shot.x) return false;
+        if (dirY[i] > 0 ? target.y + target.h <= shot.y : target.y > shot.y + last) return false;
+        int from = dirY[i] > 0 ? shot.y + last : shot.y;
+        int to = dirY[i] > 0 ? max(from, target.y) : min(from, target.y + target.h - 1);
+        return flow.pathClear(shot.x, from, shot.x, to) &&
+               flow.pathClear(shot.x + last, from, shot.x + last, to);
+    }
+
+    // Scheduled decision: where to head and whether to fire. Tanks near the
+    // target re-decide often, distant or stuck ones rarely.
+    void decide(int i, const MapSize& map, const FlowField& flow, const SDL_Rect& target) {
+        EnemyBrain& mind = brain[i];
+        int cell = map.tileIndex(x[i], y[i], TILE_SIZE);
+        int targetCell = map.tileIndex(target.x, target.y, target.w);
+        mind.heading = flow.direction(cell);
+        bool idle = mind.heading < 0;
+        if (idle) mind.heading = nextRandom(mind.rng) % 4;
+        if (mind.shootDelay == 0 && canHit(i, target, flow)) {
+            mind.wantsShoot = true;
+            mind.shootDelay = mind.fireCooldown;
+        }
+
+        int tiles = abs(cell % map.width - targetCell % map.width) + abs(cell / map.width - targetCell / map.width);
+        if (idle || tiles >= 20) mind.thinkInterval = 36;
+        else if (tiles >= 8) mind.thinkInterval = 12;
+        else mind.thinkInterval = 4;
+    }
+
+    // Fixed-rate step along the current heading
+    void step(int i, const MapSize& map, const WallStore& walls) {
+        EnemyBrain& mind = brain[i];
+        if (--mind.moveDelay > 0) return;
+        mind.moveDelay = 15;
+
+        int cell = map.tileIndex(x[i], y[i], TILE_SIZE);
+        dirX[i] = DIRECTIONS[mind.heading][0] * 5;
+        dirY[i] = DIRECTIONS[mind.heading][1] * 5;
+
+        // Line up with the current tile before turning so the tank fits between walls
+        int stepX = dirX[i], stepY = dirY[i];
+        int tileX = (cell % map.width) * TILE_SIZE;
+        int tileY = (cell / map.width) * TILE_SIZE;
+        if (dirX[i] != 0 && y[i] != tileY) {
+            stepX = 0;
+            stepY = y[i] < tileY ? 5 : -5;
+        } else if (dirY[i] != 0 && x[i] != tileX) {
+            stepY = 0;
+            stepX = x[i] < tileX ? 5 : -5;
+        }
+
+        if (canMoveTo(x[i] + stepX, y[i] + stepY, walls, map)) {
+            mind.nextX = x[i] + stepX;
+            mind.nextY = y[i] + stepY;
+        }
+    }
+
+    // Read phase: fills nextX/nextY and wantsShoot from the shared map without
+    // touching anything but tank i, so many tanks can think in parallel
+    void think(int i, const MapSize& map, const WallStore& walls, const FlowField& flow, const SDL_Rect& target) {
+        EnemyBrain& mind = brain[i];
+        mind.nextX = x[i];
+        mind.nextY = y[i];
+        mind.wantsShoot = false;
+        if (mind.shootDelay > 0) mind.shootDelay--;
+        if (mind.thinkNow) decide(i, map, flow, target);
+        step(i, map, walls);
+    }
+
+    // Write phase
+    void applyMove(int i) {
+        place(i, brain[i].nextX, brain[i].nextY);
+    }
+
+    void shoot(int i, BulletStore& bullets) {
+        SDL_Rect shot = muzzle(i);
+        bullets.spawn(shot.x, shot.y, dirX[i], dirY[i], TEAM_ENEMY);
+    }
+};
+
+// Observation channels, one map-sized plane each
+enum ObservationChannel {
+    OBS_WALL,
+    OBS_PLAYER,
+    OBS_ENEMY,
+    OBS_PLAYER_BULLET_UP,
+    OBS_PLAYER_BULLET_DOWN,
+    OBS_PLAYER_BULLET_LEFT,
+    OBS_PLAYER_BULLET_RIGHT,
+    OBS_ENEMY_BULLET_UP,
+    OBS_ENEMY_BULLET_DOWN,
+    OBS_ENEMY_BULLET_LEFT,
+    OBS_ENEMY_BULLET_RIGHT,
+    OBS_CHANNELS
+};
+
+class ObservationEncoder {
+public:
+    // Channel-major uint8 tensor handed to agents, saturates at 255 per cell
+    vector<Uint8> data;
+    // Exact per-cell counts so entities can leave a crowded cell again
+    vector<Uint16> counts;
+    MapSize map;
+
+    ObservationEncoder() {
+        resize(MapSize());
+    }
+
+    void resize(const MapSize& size) {
+        map = size;
+        data.assign(OBS_CHANNELS * map.tiles(), 0);
+        counts.assign(OBS_CHANNELS * map.tiles(), 0);
+    }
+
+    void clear() {
+        fill(data.begin(), data.end(), 0);
+        fill(counts.begin(), counts.end(), 0);
+    }
+
+    int cellAt(int x, int y, int size) const {
+        return map.tileIndex(x, y, size);
+    }
+
+    static int bulletChannel(const BulletStore& bullets, int i) {
+        int base = bullets.team[i] == TEAM_PLAYER ? OBS_PLAYER_BULLET_UP : OBS_ENEMY_BULLET_UP;
+        if (bullets.dy[i] > 0) return base + 1;
+        if (bullets.dx[i] < 0) return base + 2;
+        if (bullets.dx[i] > 0) return base + 3;
+        return base;
+    }
+
+    void add(int channel, int cell) {
+        int i = channel * map.tiles() + cell;
+        counts[i]++;
+        data[i] = (Uint8)min<int>(counts[i], 255);
+    }
+
+    void remove(int channel, int cell) {
+        int i = channel * map.tiles() + cell;
+        if (counts[i] > 0) counts[i]--;
+        data[i] = (Uint8)min<int>(counts[i], 255);
+    }
+
+    // Moves an entity to the cell under (x, y); only touches the buffer when the cell changes
+    void place(int channel, int& cell, int x, int y, int size) {
+        int newCell = cellAt(x, y, size);
+        if (newCell == cell) return;
+        if (cell >= 0) remove(channel, cell);
+        add(channel, newCell);
+        cell = newCell;
+    }
+
+    void take(int channel, int& cell) {
+        if (cell < 0) return;
+        remove(channel, cell);
+        cell = -1;
+    }
+
+    const Uint8* plane(int channel) const {
+        return &data[channel * map.tiles()];
+    }
+};
+
+#ifndef BATTLECITY_SERVER
+// Renders into a caller-sized RGBA surface with SDL's software renderer,
+// so frames can be captured without a window, an X server or a GPU
+class OffscreenCapture {
+public:
+    SDL_Surface* surface;
+    SDL_Renderer* renderer;
+    vector<Uint8> frame;
+    int width, height;
+    int frameSkip;
+    Uint32 tick;
+    Uint32 framesCaptured;
+    Uint64 startCounter;
+    Uint64 captureCounter;
+
+    OffscreenCapture() {
+        surface = NULL;
+        renderer = NULL;
+        width = 0;
+        height = 0;
+        frameSkip = 0;
+        tick = 0;
+        framesCaptured = 0;
+        startCounter = 0;
+        captureCounter = 0;
+    }
+
+    bool open(int w, int h, int skip, int logicalWidth, int logicalHeight) {
+        width = w;
+        height = h;
+        frameSkip = max(0, skip);
+        // The surface draws straight into frame, so a capture needs no readback copy
+        frame.assign(width * height * 4, 0);
+        surface = SDL_CreateRGBSurfaceWithFormatFrom(frame.data(), width, height, 32, width * 4,
+                                                     SDL_PIXELFORMAT_RGBA32);
+        if (!surface) {
+            cerr << "Failed to create capture surface: " << SDL_GetError() << endl;
+            return false;
+        }
+        renderer = SDL_CreateSoftwareRenderer(surface);
+        if (!renderer) {
+            cerr << "Failed to create software renderer: " << SDL_GetError() << endl;
+            return false;
+        }
+        // Gameplay keeps drawing in its own coordinates, the renderer scales to the capture size
+        SDL_RenderSetLogicalSize(renderer, logicalWidth, logicalHeight);
+        startCounter = SDL_GetPerformanceCounter();
+        return true;
+    }
+
+    // True on the ticks whose frame should be drawn, every (frameSkip + 1)th tick
+    bool due() {
+        return tick++ % (frameSkip + 1) == 0;
+    }
+
+    void begin() {
+        captureCounter -= SDL_GetPerformanceCounter();
+    }
+
+    void end() {
+        SDL_RenderPresent(renderer);
+        captureCounter += SDL_GetPerformanceCounter();
+        framesCaptured++;
+    }
+
+    double captureRate() const {
+        double seconds = (double)(SDL_GetPerformanceCounter() - startCounter) / SDL_GetPerformanceFrequency();
+        return seconds > 0 ? framesCaptured / seconds : 0;
+    }
+
+    void report() const {
+        double perFrame = framesCaptured ? (double)captureCounter * 1000.0 / SDL_GetPerformanceFrequency() / framesCaptured : 0;
+        cout << "Captured " << framesCaptured << " frames at " << width << "x" << height
+             << " (skip " << frameSkip << "): " << captureRate() << " frames/s, "
+             << perFrame << " ms/frame" << endl;
+    }
+
+    ~OffscreenCapture() {
+        if (renderer) SDL_DestroyRenderer(renderer);
+        if (surface) SDL_FreeSurface(surface);
+    }
+};
+
+// Single-producer/single-consumer frame queue drained by an encoder thread.
+// The game thread only copies into a preallocated slot and never touches disk;
+// when the encoder falls behind, frames are dropped and counted instead of waiting.
+class FrameRecorder {
+public:
+    static const int SLOTS = 8;
+    vector<Uint8> slots[SLOTS];
+    atomic<Uint32> head;
+    atomic<Uint32> tail;
+    atomic<bool> stopping;
+    // The encoder sleeps on this while the ring is empty
+    mutex wakeLock;
+    condition_variable wake;
+    thread encoder;
+    string path;
+    bool png;
+    int width, height;
+    // Frame rate as a ratio, so frame skips that don't divide 60 stay exact
+    int fpsNum, fpsDen;
+    Uint32 framesDropped;
+    Uint32 framesWritten;
+
+    FrameRecorder() : head(0), tail(0), stopping(false) {
+        png = false;
+        width = 0;
+        height = 0;
+        fpsNum = 60;
+        fpsDen = 1;
+        framesDropped = 0;
+        framesWritten = 0;
+    }
+
+    bool recording() const {
+        return encoder.joinable();
+    }
+
+    // Paths ending in .png become a numbered PNG sequence, anything else a raw Y4M stream
+    bool start(const string& outputPath, int w, int h, int rateNum, int rateDen = 1) {
+        if (recording()) {
+            cerr << "Already recording to " << path << endl;
+            return false;
+        }
+        path = outputPath;
+        width = w;
+        height = h;
+        fpsNum = rateNum;
+        fpsDen = max(1, rateDen);
+        png = path.size() > 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+        for (auto& slot : slots) slot.assign(width * height * 4, 0);
+        FILE* file = NULL;
+        if (!png) {
+            file = fopen(path.c_str(), "wb");
+            if (!file) {
+                cerr << "Failed to open recording " << path << endl;
+                return false;
+            }
+            fprintf(file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n", width, height, fpsNum, fpsDen);
+        }
+        head = 0;
+        tail = 0;
+        framesDropped = 0;
+        framesWritten = 0;
+        stopping = false;
+        encoder = thread(&FrameRecorder::encodeLoop, this, file);
+        return true;
+    }
+
+    // Returns the next free RGBA slot, or NULL when the queue is full and the frame is dropped
+    Uint8* acquire() {
+        Uint32 h = head.load(memory_order_relaxed);
+        if (h - tail.load(memory_order_acquire) == SLOTS) {
+            framesDropped++;
+            return NULL;
+        }
+        return slots[h % SLOTS].data();
+    }
+
+    void publish() {
+        head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+        signal();
+    }
+
+    // Taking the lock orders the new head or stop flag against the encoder's
+    // check, so it can't miss the wakeup between checking and sleeping
+    void signal() {
+        { lock_guard<mutex> guard(wakeLock); }
+        wake.notify_one();
+    }
+
+    void push(const Uint8* rgba) {
+        Uint8* slot = acquire();
+        if (!slot) return;
+        memcpy(slot, rgba, width * height * 4);
+        publish();
+    }
+
+    void encodeLoop(FILE* file) {
+        vector<Uint8> planes(png ? 0 : width * height * 3);
+        while (true) {
+            Uint32 t = tail.load(memory_order_relaxed);
+            if (t == head.load(memory_order_acquire)) {
+                if (stopping) break;
+                unique_lock<mutex> guard(wakeLock);
+                wake.wait(guard, [&] { return stopping || head.load(memory_order_acquire) != t; });
+                continue;
+            }
+            const Uint8* rgba = slots[t % SLOTS].data();
+            if (png) {
+                writePng(rgba);
+            } else {
+                writeY4m(file, rgba, planes);
+            }
+            tail.store(t + 1, memory_order_release);
+            framesWritten++;
+        }
+        if (file) fclose(file);
+    }
+
+    void writeY4m(FILE* file, const Uint8* rgba, vector<Uint8>& planes) {
+        int n = width * height;
+        Uint8* yPlane = planes.data();
+        Uint8* uPlane = yPlane + n;
+        Uint8* vPlane = uPlane + n;
+        // BT.601 studio range in fixed point
+        for (int i = 0; i < n; i++) {
+            int r = rgba[i * 4], g = rgba[i * 4 + 1], b = rgba[i * 4 + 2];
+            yPlane[i] = (Uint8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            uPlane[i] = (Uint8)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            vPlane[i] = (Uint8)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+        fputs("FRAME\n", file);
+        fwrite(planes.data(), 1, planes.size(), file);
+    }
+
+    void writePng(const Uint8* rgba) {
+        char name[32];
+        snprintf(name, sizeof(name), "_%05u.png", framesWritten);
+        string file = path.substr(0, path.size() - 4) + name;
+        SDL_Surface* frame = SDL_CreateRGBSurfaceWithFormatFrom((void*)rgba, width, height, 32, width * 4,
+                                                                SDL_PIXELFORMAT_RGBA32);
+        if (frame) {
+            IMG_SavePNG(frame, file.c_str());
+            SDL_FreeSurface(frame);
+        }
+    }
+
+    void stop() {
+        if (!recording()) return;
+        stopping = true;
+        signal();
+        encoder.join();
+        cout << "Recorded " << framesWritten << " frames to " << path
+             << ", dropped " << framesDropped << endl;
+    }
+
+    ~FrameRecorder() {
+        stop();
+    }
+};
+#endif
+
+// Small persistent worker pool; parallelFor splits [0, count) into chunks that
+// the workers and the calling thread pull from until none are left
+class JobSystem {
+public:
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    // The caller's callable, borrowed for one parallelFor; copying it into a
+    // std::function could allocate every tick
+    const void* jobTarget;
+    void (*jobCall)(const void* target, int begin, int end);
+    atomic<int> nextChunk;
+    int chunkSize;
+    int count;
+    int busy;
+    Uint32 generation;
+    bool quitting;
+
+    JobSystem() : nextChunk(0) {
+        jobTarget = NULL;
+        jobCall = NULL;
+        chunkSize = 1;
+        count = 0;
+        busy = 0;
+        generation = 0;
+        quitting = false;
+    }
+
+    void start(int threads) {
+        for (int i = 1; i < threads; i++) {
+            workers.emplace_back(&JobSystem::workerLoop, this);
+        }
+    }
+
+    int threadCount() const {
+        return (int)workers.size() + 1;
+    }
+
+    void runChunks() {
+        while (true) {
+            int begin = nextChunk.fetch_add(chunkSize);
+            if (begin >= count) break;
+            jobCall(jobTarget, begin, min(count, begin + chunkSize));
+        }
+    }
+
+    void workerLoop() {
+        Uint32 seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return quitting || generation != seen; });
+                if (quitting) return;
+                seen = generation;
+            }
+            runChunks();
+            {
+                lock_guard<mutex> guard(lock);
+                if (--busy == 0) done.notify_one();
+            }
+        }
+    }
+
+    // Small batches run inline; waking the pool would cost more than the work
+    template <typename Fn>
+    void parallelFor(int total, int grain, const Fn& fn) {
+        if (workers.empty() || total <= grain) {
+            if (total > 0) fn(0, total);
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            jobTarget = &fn;
+            jobCall = [](const void* target, int begin, int end) { (*(const Fn*)target)(begin, end); };
+            count = total;
+            chunkSize = grain;
+            nextChunk = 0;
+            busy = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        runChunks();
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&] { return busy == 0; });
+    }
+
+    ~JobSystem() {
+        {
+            lock_guard<mutex> guard(lock);
+            quitting = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+};
+
+// Spreads enemy decisions over ticks. Each tank is due again thinkInterval
+// ticks after its last decision; a round-robin cursor hands out at most
+// maxThinks decisions per tick and due tanks left over go first next tick.
+// With a microsecond budget the cap follows the measured cost per decision,
+// which trades run-to-run determinism for a flat frame time.
+class AIScheduler {
+public:
+    Uint32 tick;
+    size_t cursor;
+    int maxThinks;
+    double budgetUs;
+    double costPerThinkUs;
+    int thinksThisTick;
+
+    AIScheduler() {
+        tick = 0;
+        cursor = 0;
+        maxThinks = 256;
+        budgetUs = 0;
+        costPerThinkUs = 0;
+        thinksThisTick = 0;
+    }
+
+    void select(EnemyStore& enemies) {
+        int cap = maxThinks;
+        if (budgetUs > 0 && costPerThinkUs > 0) {
+            cap = max(1, (int)(budgetUs / costPerThinkUs));
+        }
+        thinksThisTick = 0;
+        size_t count = enemies.size();
+        if (cursor >= count) cursor = 0;
+        size_t last = cursor;
+        for (size_t n = 0; n < count; n++) {
+            size_t i = (cursor + n) % count;
+            EnemyBrain& mind = enemies.brain[i];
+            mind.thinkNow = false;
+            if (!enemies.active[i] || thinksThisTick >= cap || (Sint32)(tick - mind.nextThink) < 0) continue;
+            mind.thinkNow = true;
+            mind.nextThink = tick + mind.thinkInterval;
+            thinksThisTick++;
+            last = i + 1;
+        }
+        cursor = last;
+        tick++;
+    }
+
+    // elapsed is the summed time of this tick's decisions, on every thread
+    void record(Uint64 elapsed) {
+        if (thinksThisTick == 0) return;
+        double us = elapsed * 1e6 / SDL_GetPerformanceFrequency() / thinksThisTick;
+        costPerThinkUs = costPerThinkUs > 0 ? costPerThinkUs * 0.9 + us * 0.1 : us;
+    }
+};
+
+#ifndef BATTLECITY_SERVER
+class Menu {
+public:
+    SDL_Texture* playTexture;
+    SDL_Texture* exitTexture;
+    SDL_Texture* backgroundTexture;
+    Mix_Music* backgroundMusic;
+    SDL_Rect playButton;
+    SDL_Rect exitButton;
+    bool showMenu;
+
+    Menu(SDL_Renderer* renderer) {
+        backgroundMusic = Mix_LoadMUS("nhacnen.wav");
+        if (!backgroundMusic) {
+            cerr << "Failed to load menu music: " << Mix_GetError() << endl;
+        } else {
+            Mix_VolumeMusic(64);
+            Mix_PlayMusic(backgroundMusic, -1);
+        }
+
+        backgroundTexture = IMG_LoadTexture(renderer, "backgroundmenu.png");
+        playTexture = IMG_LoadTexture(renderer, "play.png");
+        exitTexture = IMG_LoadTexture(renderer, "exit.png");
+
+        playButton = {SCREEN_WIDTH/2 - 100, 300, 200, 80};
+        exitButton = {SCREEN_WIDTH/2 - 100, 400, 200, 80};
+        showMenu = true;
+    }
+
+    void handleEvents(SDL_Event& e) {
+        if (e.type == SDL_MOUSEBUTTONDOWN) {
+            int x, y;
+            SDL_GetMouseState(&x, &y);
+            SDL_Point mousePos = {x, y};
+
+            if (SDL_PointInRect(&mousePos, &playButton)) {
+                showMenu = false;
+            }
+            if (SDL_PointInRect(&mousePos, &exitButton)) {
+                exit(0);
+            }
+        }
+    }
+
+    void render(SDL_Renderer* renderer) {
+        if (backgroundTexture) {
+            SDL_RenderCopy(renderer, backgroundTexture, NULL, NULL);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
+            SDL_RenderClear(renderer);
+        }
+
+        if (playTexture) SDL_RenderCopy(renderer, playTexture, NULL, &playButton);
+        if (exitTexture) SDL_RenderCopy(renderer, exitTexture, NULL, &exitButton);
+
+        SDL_RenderPresent(renderer);
+    }
+
+    ~Menu() {
+        SDL_DestroyTexture(backgroundTexture);
+        SDL_DestroyTexture(playTexture);
+        SDL_DestroyTexture(exitTexture);
+        if (backgroundMusic) {
+            Mix_HaltMusic();
+            Mix_FreeMusic(backgroundMusic);
+        }
+    }
+};
+#endif
+
+struct GameOptions {
+    bool headless;
+    int captureWidth;
+    int captureHeight;
+    int frameSkip;
+    string recordPath;
+    int aiThreads;
+    int aiMaxThinks;
+    double aiBudgetUs;
+    int mapWidth;
+    int mapHeight;
+    int enemyCount;
+    // Below zero keeps the classic wall grid, otherwise how many free tiles in
+    // 10000 are walled at random. Kept as an integer so server and clients
+    // build the same board.
+    int wallThreshold;
+    int enemyFireCooldown;
+    // Enemies spawn at least this many tiles (Chebyshev) from the player when the map allows
+    int spawnMinDistance;
+    // Player tanks in the match; slot 0 is the local player
+    int playerCount;
+    // Hits and victory don't end the match; used by the stress scenario
+    bool endless;
+    // Seeds each match's own generator for walls and enemy placement
+    Uint32 seed;
+    // Player input is written here as a replayable match trace
+    string tracePath;
+    // No renderer, textures or audio at all, for matches nobody on this machine watches
+    bool simulationOnly;
+    // Windowed play draws with SDL's software renderer instead of the GPU
+    bool softwareRender;
+    // Software renderers repaint only what moved since the last frame
+    bool dirtyRects;
+    // Window size; gameplay keeps its own logical size and is scaled to fit
+    int windowWidth;
+    int windowHeight;
+    bool fullscreen;
+    // Scale only by whole numbers when the window is large enough, letterboxing the rest
+    bool integerScale;
+    // Below 1, frames are drawn into a texture this much smaller and stretched
+    // up with nearest filtering, so fill cost no longer follows the window size
+    double renderScale;
+
+    GameOptions() {
+        headless = false;
+        simulationOnly = false;
+        softwareRender = false;
+        dirtyRects = true;
+        windowWidth = SCREEN_WIDTH;
+        windowHeight = SCREEN_HEIGHT;
+        fullscreen = false;
+        integerScale = true;
+        renderScale = 1;
+        captureWidth = SCREEN_WIDTH;
+        captureHeight = SCREEN_HEIGHT;
+        frameSkip = 0;
+        aiThreads = max(1, (int)thread::hardware_concurrency());
+        aiMaxThinks = 256;
+        aiBudgetUs = 0;
+        mapWidth = MAP_WIDTH;
+        mapHeight = MAP_HEIGHT;
+        enemyCount = 5;
+        wallThreshold = -1;
+        enemyFireCooldown = 70;
+        spawnMinDistance = 4;
+        playerCount = 1;
+        endless = false;
+        seed = 1;
+    }
+
+    // Fractions come in on the command line and in trace files
+    static int wallThresholdFor(double density) {
+        return density < 0 ? -1 : (int)lround(min(0.95, density) * 10000);
+    }
+
+    double wallDensity() const {
+        return wallThreshold < 0 ? -1 : wallThreshold / 10000.0;
+    }
+};
+
+// Everything needed to replay a match: the setup it started from and the
+// player's actions on every tick. Actions are U, D, L, R (5px steps) and S
+// (shoot), in the order they arrived; "-" is an idle tick. Runs of identical
+// ticks are stored as one "count actions" line.
+class MatchTrace {
+public:
+    GameOptions setup;
+    // Game::layoutHash when recorded; replays refuse a map generated differently
+    Uint64 layout;
+    vector<string> ticks;
+
+    MatchTrace() {
+        layout = 0;
+    }
+
+    void apply(GameOptions& options) const {
+        options.mapWidth = setup.mapWidth;
+        options.mapHeight = setup.mapHeight;
+        options.enemyCount = setup.enemyCount;
+        options.wallThreshold = setup.wallThreshold;
+        options.enemyFireCooldown = setup.enemyFireCooldown;
+        options.endless = setup.endless;
+        options.seed = setup.seed;
+    }
+
+    bool save(const string& path) const {
+        ofstream out(path.c_str());
+        if (!out) return false;
+        out << "battlecity-trace 1\n"
+            << "seed " << setup.seed << "\n"
+            << "map " << setup.mapWidth << "x" << setup.mapHeight << "\n"
+            << "enemies " << setup.enemyCount << "\n"
+            << "wall-density " << setup.wallDensity() << "\n"
+            << "fire-cooldown " << setup.enemyFireCooldown << "\n"
+            << "endless " << (setup.endless ? 1 : 0) << "\n"
+            << "layout " << hex << layout << dec << "\n"
+            << "ticks\n";
+        for (size_t i = 0; i < ticks.size();) {
+            size_t run = 1;
+            while (i + run < ticks.size() && ticks[i + run] == ticks[i]) run++;
+            out << run << " " << (ticks[i].empty() ? "-" : ticks[i]) << "\n";
+            i += run;
+        }
+        return (bool)out;
+    }
+
+    bool load(const string& path) {
+        ifstream in(path.c_str());
+        string key;
+        if (!(in >> key) || key != "battlecity-trace") return false;
+        int version = 0;
+        in >> version;
+        int endless = 0;
+        double density = -1;
+        while (in >> key && key != "ticks") {
+            if (key == "seed") in >> setup.seed;
+            else if (key == "map") {
+                string size;
+                in >> size;
+                sscanf(size.c_str(), "%dx%d", &setup.mapWidth, &setup.mapHeight);
+            }
+            else if (key == "enemies") in >> setup.enemyCount;
+            else if (key == "wall-density") {
+                in >> density;
+                setup.wallThreshold = GameOptions::wallThresholdFor(density);
+            }
+            else if (key == "fire-cooldown") in >> setup.enemyFireCooldown;
+            else if (key == "endless") in >> endless;
+            else if (key == "layout") in >> hex >> layout >> dec;
+        }
+        setup.endless = endless != 0;
+        ticks.clear();
+        int run;
+        string actions;
+        while (in >> run >> actions) {
+            ticks.insert(ticks.end(), run, actions == "-" ? string() : actions);
+        }
+        return key == "ticks" && !ticks.empty();
+    }
+};
+
+// Simulation state hashed per subsystem, so a mismatch between peers also says
+// where they diverged
+enum HashPart {
+    HASH_WALLS,
+    HASH_PLAYERS,
+    HASH_ENEMIES,
+    HASH_BULLETS,
+    HASH_PARTS
+};
+
+const char* const HASH_PART_NAMES[HASH_PARTS] = {"walls", "players", "enemies", "bullets"};
+
+struct StateHash {
+    Uint64 part[HASH_PARTS];
+};
+
+// Everything update() reads or writes, so ticks can be undone and replayed.
+// Copy-assigning into a kept GameState reuses its buffers.
+struct GameState {
+    WallStore walls;
+    TankStore players;
+    SlotMap<EnemyStore> enemies;
+    BulletStore bullets;
+    ObservationEncoder observation;
+    FlowField flowField;
+    FreeTiles spawnTiles;
+    AIScheduler scheduler;
+    Uint64 wallHash;
+    bool isGameOver;
+    bool isVictory;
+    bool running;
+};
+
+#ifndef BATTLECITY_SERVER
+enum ScreenState { SCREEN_PLAYING, SCREEN_VICTORY, SCREEN_GAME_OVER };
+
+// Everything one frame needs, copied out of the simulation so drawing never
+// reads live game state. Wall rectangles never change after the map is
+// generated, so only which walls still stand is copied.
+struct RenderSnapshot {
+    Uint32 tick;
+    ScreenState screen;
+    vector<Uint8> walls;
+    vector<SDL_Rect> players;
+    vector<SDL_Rect> enemies;
+    vector<SDL_Rect> bullets;
+    // TankFacing of each entry in players and enemies
+    vector<Uint8> playerFacing;
+    vector<Uint8> enemyFacing;
+
+    RenderSnapshot() {
+        tick = 0;
+        screen = SCREEN_PLAYING;
+    }
+
+    void reserve(size_t playerCount, size_t enemyCount, size_t bulletCount) {
+        players.reserve(playerCount);
+        enemies.reserve(enemyCount);
+        bullets.reserve(bulletCount);
+        playerFacing.reserve(playerCount);
+        enemyFacing.reserve(enemyCount);
+    }
+};
+
+// Screen tiles that changed since the last frame, for renderers whose back
+// buffer survives presenting. Marked tiles are handed back as one rectangle
+// per horizontal run, clipped to the screen.
+class DirtyTiles {
+public:
+    int width, height;
+    int columns, rows;
+    vector<Uint8> cells;
+    int marked;
+    vector<SDL_Rect> rects;
+
+    DirtyTiles() {
+        width = height = 0;
+        columns = rows = 0;
+        marked = 0;
+    }
+
+    void resize(int pixelWidth, int pixelHeight) {
+        width = pixelWidth;
+        height = pixelHeight;
+        columns = (pixelWidth + TILE_SIZE - 1) / TILE_SIZE;
+        rows = (pixelHeight + TILE_SIZE - 1) / TILE_SIZE;
+        cells.assign(columns * rows, 0);
+        rects.reserve(cells.size());
+        marked = 0;
+    }
+
+    void clear() {
+        fill(cells.begin(), cells.end(), 0);
+        marked = 0;
+    }
+
+    void mark(const SDL_Rect& r) {
+        int left = max(0, r.x / TILE_SIZE);
+        int top = max(0, r.y / TILE_SIZE);
+        int right = min(columns - 1, (r.x + r.w - 1) / TILE_SIZE);
+        int bottom = min(rows - 1, (r.y + r.h - 1) / TILE_SIZE);
+        for (int row = top; row <= bottom; row++) {
+            for (int column = left; column <= right; column++) {
+                Uint8& cell = cells[row * columns + column];
+                marked += !cell;
+                cell = 1;
+            }
+        }
+    }
+
+    void mark(const vector<SDL_Rect>& list) {
+        for (const SDL_Rect& r : list) mark(r);
+    }
+
+    double coverage() const {
+        return cells.empty() ? 0 : (double)marked / cells.size();
+    }
+
+    const vector<SDL_Rect>& merge() {
+        rects.clear();
+        for (int row = 0; row < rows; row++) {
+            const Uint8* line = &cells[row * columns];
+            for (int column = 0; column < columns; column++) {
+                if (!line[column]) continue;
+                int start = column;
+                while (column + 1 < columns && line[column + 1]) column++;
+                int x = start * TILE_SIZE;
+                int y = row * TILE_SIZE;
+                SDL_Rect r = {x, y, min((column + 1) * TILE_SIZE, width) - x, min(y + TILE_SIZE, height) - y};
+                rects.push_back(r);
+            }
+        }
+        return rects;
+    }
+};
+
+enum TankFacing { FACING_UP, FACING_RIGHT, FACING_DOWN, FACING_LEFT, FACING_COUNT };
+
+Uint8 tankFacing(int dirX, int dirY) {
+    if (dirX > 0) return FACING_RIGHT;
+    if (dirX < 0) return FACING_LEFT;
+    return dirY > 0 ? FACING_DOWN : FACING_UP;
+}
+
+// Tank sprites with every facing rotated once at load time: one row per team,
+// one frame per TankFacing. The source images face up. A whole team is then
+// a single textured geometry call, however many tanks it has.
+class TankAtlas {
+public:
+    SDL_Texture* texture;
+    int frameSize;
+    // One frame's size in texture coordinates
+    float frameU, frameV;
+    vector<SDL_Vertex> vertices;
+    vector<int> indices;
+
+    TankAtlas() {
+        texture = NULL;
+        frameSize = 0;
+        frameU = frameV = 0;
+    }
+
+    bool load(SDL_Renderer* renderer, const char* const* paths, int rows) {
+        SDL_Surface* sheet = NULL;
+        for (int row = 0; row < rows; row++) {
+            SDL_Surface* loaded = IMG_Load(paths[row]);
+            SDL_Surface* source = loaded ? SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0) : NULL;
+            SDL_FreeSurface(loaded);
+            if (!source || source->w != source->h || (sheet && source->w != frameSize)) {
+                cerr << "Failed to load tank sprite " << paths[row] << ": " << IMG_GetError() << endl;
+                SDL_FreeSurface(source);
+                SDL_FreeSurface(sheet);
+                return false;
+            }
+            if (!sheet) {
+                frameSize = source->w;
+                sheet = SDL_CreateRGBSurfaceWithFormat(0, frameSize * FACING_COUNT, frameSize * rows, 32,
+                                                       SDL_PIXELFORMAT_RGBA32);
+                if (!sheet) {
+                    SDL_FreeSurface(source);
+                    return false;
+                }
+            }
+            int n = frameSize;
+            for (int facing = 0; facing < FACING_COUNT; facing++) {
+                for (int y = 0; y < n; y++) {
+                    Uint32* out = (Uint32*)((Uint8*)sheet->pixels + (row * n + y) * sheet->pitch) + facing * n;
+                    for (int x = 0; x < n; x++) {
+                        // Turning clockwise by facing quarter turns
+                        int sx = facing == FACING_UP ? x : facing == FACING_RIGHT ? y :
+                                 facing == FACING_DOWN ? n - 1 - x : n - 1 - y;
+                        int sy = facing == FACING_UP ? y : facing == FACING_RIGHT ? n - 1 - x :
+                                 facing == FACING_DOWN ? n - 1 - y : x;
+                        out[x] = *((const Uint32*)((const Uint8*)source->pixels + sy * source->pitch) + sx);
+                    }
+                }
+            }
+            SDL_FreeSurface(source);
+        }
+        frameU = 1.0f / FACING_COUNT;
+        frameV = 1.0f / rows;
+        texture = SDL_CreateTextureFromSurface(renderer, sheet);
+        SDL_FreeSurface(sheet);
+        if (!texture) return false;
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        return true;
+    }
+
+    void reserve(size_t tanks) {
+        vertices.reserve(tanks * 4);
+        indices.reserve(tanks * 6);
+    }
+
+    // False if the renderer can't draw geometry, so the caller can fall back
+    bool draw(SDL_Renderer* renderer, int row, const vector<SDL_Rect>& rects, const vector<Uint8>& facing) {
+        if (rects.empty()) return true;
+        vertices.clear();
+        indices.clear();
+        for (size_t i = 0; i < rects.size(); i++) {
+            const SDL_Rect& r = rects[i];
+            float u0 = facing[i] * frameU;
+            float v0 = row * frameV;
+            float left = (float)r.x, top = (float)r.y;
+            float right = (float)(r.x + r.w), bottom = (float)(r.y + r.h);
+            int base = (int)vertices.size();
+            vertices.push_back({{left, top}, {255, 255, 255, 255}, {u0, v0}});
+            vertices.push_back({{right, top}, {255, 255, 255, 255}, {u0 + frameU, v0}});
+            vertices.push_back({{right, bottom}, {255, 255, 255, 255}, {u0 + frameU, v0 + frameV}});
+            vertices.push_back({{left, bottom}, {255, 255, 255, 255}, {u0, v0 + frameV}});
+            const int quad[6] = {0, 1, 2, 0, 2, 3};
+            for (int corner : quad) indices.push_back(base + corner);
+        }
+        return SDL_RenderGeometry(renderer, texture, vertices.data(), (int)vertices.size(),
+                                  indices.data(), (int)indices.size()) == 0;
+    }
+
+    void destroy() {
+        if (texture) SDL_DestroyTexture(texture);
+        texture = NULL;
+    }
+};
+
+// Hands whole frames from one producer thread to one consumer. The producer
+// always has a free slot to fill and the consumer always gets the newest
+// complete one; neither ever waits for the other. Frames the consumer was too
+// slow to see are simply overwritten.
+template <typename T>
+class TripleBuffer {
+public:
+    static const int FRESH = 4;
+    T slots[3];
+    // Slot holding the newest published frame, with FRESH set until it is taken
+    atomic<int> ready;
+    int back;
+    int front;
+
+    TripleBuffer() : ready(1) {
+        back = 0;
+        front = 2;
+    }
+
+    T& writeSlot() {
+        return slots[back];
+    }
+
+    void publish() {
+        back = ready.exchange(back | FRESH) & 3;
+    }
+
+    // Moves to the newest frame; false if nothing was published since the last call
+    bool acquire() {
+        if (!(ready.load() & FRESH)) return false;
+        front = ready.exchange(front) & 3;
+        return true;
+    }
+
+    const T& readSlot() const {
+        return slots[front];
+    }
+};
+#endif
+
+struct StressResult {
+    int ticks;
+    double ticksPerSecond;
+    double averageMs;
+    double maxMs;
+    size_t peakMemory;
+};
+
+// Peak resident set size of the process in bytes, 0 where unsupported
+size_t peakMemoryBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#elif defined(__linux__)
+    FILE* status = fopen("/proc/self/status", "r");
+    if (!status) return 0;
+    char line[128];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) break;
+    }
+    fclose(status);
+    return kb * 1024;
+#else
+    return 0;
+#endif
+}
+
+class Game {
+public:
+    bool isGameOver;
+    bool running;
+    bool isVictory;
+    MapSize map;
+    WallStore walls;
+    TankStore players;
+    int enemyNumber;
+    SlotMap<EnemyStore> enemies;
+    Uint32 endTime;
+    BulletStore bullets;
+    FrameArena arena;
+    size_t arenaAllocations;
+    ObservationEncoder observation;
+    FlowField flowField;
+    FreeTiles spawnTiles;
+    GameOptions options;
+    JobSystem ai;
+    AIScheduler scheduler;
+    MatchTrace trace;
+    string tickActions;
+    // Set while rollback replays ticks that were already heard once
+    bool resimulating;
+    // Walls and spawns come only from options.seed, never from rand(), so
+    // matches built at once on different threads still match their clients
+    mt19937 layoutRng;
+    // XOR of a key per standing wall, updated as walls fall
+    Uint64 wallHash;
+    // Walls, players and enemies as generated, before the first tick
+    Uint64 layoutHash;
+#ifndef BATTLECITY_SERVER
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    SDL_Texture* wallTexture;
+    SDL_Texture* winTexture;
+    SDL_Texture* gameOverTexture;
+    // Rows are indexed by Team; empty if the sprites failed to load
+    TankAtlas tankSprites;
+    Mix_Chunk* playerShootSound;
+    Mix_Chunk* enemyShootSound;
+    Mix_Music* backgroundMusic;
+    OffscreenCapture capture;
+    FrameRecorder recorder;
+    // Scratch state for drawing on the simulation thread
+    RenderSnapshot frame;
+    // Windowed play: the simulation publishes here and the main thread draws
+    TripleBuffer<RenderSnapshot> frames;
+    mutex inputMutex;
+    string pendingInput;
+    atomic<bool> quitRequested;
+    atomic<bool> simulationDone;
+    // Screen size in the coordinates gameplay draws with
+    int logicalWidth;
+    int logicalHeight;
+    // Low resolution target for options.renderScale, NULL when drawing straight to the screen
+    SDL_Texture* sceneTarget;
+    float sceneScaleX, sceneScaleY;
+    // Board and standing walls, drawn once; partial redraws copy from it
+    SDL_Texture* backgroundCache;
+    bool partialRedraw;
+    // What is on screen now, so the next frame knows what to erase
+    RenderSnapshot drawn;
+    bool drawnValid;
+    DirtyTiles dirty;
+#endif
+
+    Game(const GameOptions& gameOptions = GameOptions())
+        : map(gameOptions.mapWidth, gameOptions.mapHeight), options(gameOptions) {
+        running = true;
+        isGameOver = false;
+        isVictory = false;
+        enemyNumber = options.enemyCount;
+        endTime = 0;
+        arenaAllocations = 0;
+        resimulating = false;
+
+        ai.start(options.aiThreads);
+        bullets.reserve(1024);
+        // Kills and respawns recycle slots, so the free list never outgrows this
+        enemies.reserve(options.enemyCount);
+        scheduler.maxThinks = options.aiMaxThinks;
+        scheduler.budgetUs = options.aiBudgetUs;
+        observation.resize(map);
+        flowField.resize(map.width, map.height);
+        trace.setup = options;
+        layoutRng.seed(options.seed);
+        placePlayers();
+        generateWalls();
+        wallHash = 0;
+        for (int w = 0; w < walls.size(); w++) wallHash ^= mix64(w + 1);
+        resetSpawnTiles();
+        spawnEnemies();
+        layoutHash = layoutChecksum();
+        trace.layout = layoutHash;
+        resetObservation();
+        flowField.build(walls);
+#ifndef BATTLECITY_SERVER
+        openPresentation();
+#endif
+    }
+
+#ifndef BATTLECITY_SERVER
+    // Window, audio and textures, or the offscreen capture when headless
+    void openPresentation() {
+        quitRequested = false;
+        simulationDone = false;
+        window = NULL;
+        backgroundMusic = NULL;
+        playerShootSound = NULL;
+        enemyShootSound = NULL;
+        logicalWidth = map.width == MAP_WIDTH ? SCREEN_WIDTH : map.pixelWidth();
+        logicalHeight = map.height == MAP_HEIGHT ? SCREEN_HEIGHT : map.pixelHeight();
+
+        if (options.simulationOnly) {
+            // Rendering is never called, so there's nothing to draw into
+            options.headless = true;
+            renderer = NULL;
+        } else if (options.headless) {
+            if (!capture.open(options.captureWidth, options.captureHeight, options.frameSkip,
+                              logicalWidth, logicalHeight)) {
+                running = false;
+            }
+            renderer = capture.renderer;
+        } else {
+            SDL_Init(SDL_INIT_VIDEO);
+            Uint32 windowFlags = SDL_WINDOW_SHOWN | (options.fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+            window = SDL_CreateWindow("Battle City", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                     options.windowWidth, options.windowHeight, windowFlags);
+            // Presenting waits for vsync on the main thread only; the simulation has its own
+            Uint32 rendererFlags = options.softwareRender ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED;
+            renderer = SDL_CreateRenderer(window, -1, rendererFlags | SDL_RENDERER_PRESENTVSYNC);
+            // Gameplay always draws in logical pixels. Whole-number scales keep
+            // every tile the same size on screen; a window smaller than the map
+            // (larger stress maps) can only be shrunk to fit.
+            int outputWidth = 0, outputHeight = 0;
+            SDL_GetRendererOutputSize(renderer, &outputWidth, &outputHeight);
+            SDL_RenderSetLogicalSize(renderer, logicalWidth, logicalHeight);
+            bool fits = outputWidth >= logicalWidth && outputHeight >= logicalHeight;
+            SDL_RenderSetIntegerScale(renderer, options.integerScale && fits ? SDL_TRUE : SDL_FALSE);
+
+            Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
+            backgroundMusic = Mix_LoadMUS("nhacnen.wav");
+            Mix_PlayMusic(backgroundMusic, -1);
+
+            playerShootSound = Mix_LoadWAV("music.wav");
+            enemyShootSound = Mix_LoadWAV("music.wav");
+            Mix_VolumeChunk(playerShootSound, 10);
+            Mix_VolumeChunk(enemyShootSound, 10);
+        }
+
+        wallTexture = NULL;
+        winTexture = NULL;
+        gameOverTexture = NULL;
+        if (renderer) {
+            IMG_Init(IMG_INIT_PNG);
+            wallTexture = IMG_LoadTexture(renderer, "wall.png");
+            winTexture = IMG_LoadTexture(renderer, "win.png");
+            gameOverTexture = IMG_LoadTexture(renderer, "gameover.png");
+            const char* const tankSheets[] = {"tank.png", "tank2.png"};
+            tankSprites.load(renderer, tankSheets, 2);
+        }
+
+        sceneTarget = NULL;
+        sceneScaleX = sceneScaleY = 1;
+        int sceneWidth = logicalWidth, sceneHeight = logicalHeight;
+        SDL_RendererInfo info;
+        bool targets = renderer && SDL_GetRendererInfo(renderer, &info) == 0 &&
+                       (info.flags & SDL_RENDERER_TARGETTEXTURE);
+        if (targets && options.renderScale < 1) {
+            sceneWidth = max(1, (int)lround(logicalWidth * options.renderScale));
+            sceneHeight = max(1, (int)lround(logicalHeight * options.renderScale));
+            sceneTarget = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                            sceneWidth, sceneHeight);
+            if (sceneTarget) SDL_SetTextureScaleMode(sceneTarget, SDL_ScaleModeNearest);
+            sceneScaleX = (float)sceneWidth / logicalWidth;
+            sceneScaleY = (float)sceneHeight / logicalHeight;
+        }
+
+        // A GPU back buffer is undefined after presenting, so only software
+        // renderers, or a scene target texture, keep last frame's pixels to
+        // patch. Headless frames nobody records aren't worth a second
+        // full-scene texture.
+        backgroundCache = NULL;
+        partialRedraw = false;
+        drawnValid = false;
+        bool framesSeen = !options.headless || !options.recordPath.empty();
+        if (targets && options.dirtyRects && framesSeen && ((info.flags & SDL_RENDERER_SOFTWARE) || sceneTarget)) {
+            backgroundCache = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                                sceneWidth, sceneHeight);
+            partialRedraw = backgroundCache != NULL;
+            dirty.resize(logicalWidth, logicalHeight);
+        }
+
+        frame.reserve(options.playerCount, options.enemyCount, 1024);
+        for (auto& slot : frames.slots) slot.reserve(options.playerCount, options.enemyCount, 1024);
+        drawn.reserve(options.playerCount, options.enemyCount, 1024);
+        tankSprites.reserve(max(options.playerCount, options.enemyCount));
+
+        if (running && renderer && !options.recordPath.empty()) {
+            if (options.headless) {
+                recorder.start(options.recordPath, capture.width, capture.height, 60, capture.frameSkip + 1);
+            } else {
+                // Readback covers the scaled game area, not the letterbox bars
+                float scaleX, scaleY;
+                SDL_RenderGetScale(renderer, &scaleX, &scaleY);
+                recorder.start(options.recordPath, (int)(logicalWidth * scaleX), (int)(logicalHeight * scaleY), 60);
+            }
+        }
+    }
+#endif
+
+    // Along the bottom row, slot 0 in the middle and the rest alternating outwards
+    void placePlayers() {
+        int count = max(1, options.playerCount);
+        int centre = (map.width - 1) / 2, row = map.height - 2;
+        for (int i = 0; i < count; i++) {
+            int offset = (i + 1) / 2 * 2 * (i % 2 ? -1 : 1);
+            int col = max(1, min(map.width - 2, centre + offset));
+            players.add(col * TILE_SIZE, row * TILE_SIZE, -1);
+        }
+    }
+
+    // Index of the tank enemies hunt: the first player still in the match
+    int target() const {
+        for (int p = 0; p < players.size(); p++) {
+            if (players.active[p]) return p;
+        }
+        return 0;
+    }
+
+    bool anyPlayerActive() const {
+        for (int p = 0; p < players.size(); p++) {
+            if (players.active[p]) return true;
+        }
+        return false;
+    }
+
+    void generateWalls() {
+        if (options.wallThreshold < 0) {
+            for (int i = 2; i < map.height - 1; i += 3) {
+                for (int j = 2; j < map.width - 1; j += 3) {
+                    walls.add(j * TILE_SIZE, i * TILE_SIZE);
+                }
+            }
+            return;
+        }
+        // Random walls, keeping each player's tile and the tiles around it open
+        int threshold = options.wallThreshold;
+        for (int i = 1; i < map.height - 1; i++) {
+            for (int j = 1; j < map.width - 1; j++) {
+                bool nearPlayer = false;
+                for (int p = 0; p < players.size(); p++) {
+                    nearPlayer |= abs(i - players.y[p] / TILE_SIZE) <= 1 && abs(j - players.x[p] / TILE_SIZE) <= 1;
+                }
+                if (nearPlayer) continue;
+                if ((int)(layoutRng() % 10000) < threshold) {
+                    walls.add(j * TILE_SIZE, i * TILE_SIZE);
+                }
+            }
+        }
+    }
+
+    Uint64 layoutChecksum() const {
+        WordChecksum layout;
+        for (int w = 0; w < walls.size(); w++) layout.add((Uint64)(Uint32)walls.rect[w].x << 32 | (Uint32)walls.rect[w].y);
+        for (int p = 0; p < players.size(); p++) layout.add((Uint64)(Uint32)players.x[p] << 32 | (Uint32)players.y[p]);
+        for (int e = 0; e < enemies.size(); e++) {
+            layout.add((Uint64)(Uint32)enemies.x[e] << 32 | (Uint32)enemies.y[e]);
+            layout.add(enemies.brain[e].rng);
+        }
+        return layout.finish();
+    }
+
+    // Enemies keep clear of the border ring and the row/column next to it
+    bool inSpawnArea(int cell) const {
+        int col = cell % map.width, row = cell / map.width;
+        return col >= 2 && col < map.width - 2 && row >= 2 && row < map.height - 2;
+    }
+
+    void resetSpawnTiles() {
+        spawnTiles.reset(map.tiles());
+        for (int cell = 0; cell < map.tiles(); cell++) {
+            if (inSpawnArea(cell)) spawnTiles.add(cell);
+        }
+        for (int w = 0; w < walls.size(); w++) {
+            if (walls.active[w]) spawnTiles.remove(map.tileIndex(walls.rect[w].x, walls.rect[w].y, TILE_SIZE));
+        }
+    }
+
+    // Draws spawn tiles uniformly from the free list: one pass to drop tiles near the
+    // player, then O(1) per enemy, however dense the walls are
+    void spawnEnemies() {
+        enemies.clear();
+        FrameVector<int> candidates{ArenaAllocator<int>(arena)};
+        candidates.reserve(spawnTiles.size());
+        for (int cell : spawnTiles.tiles) {
+            int distance = INT_MAX;
+            for (int p = 0; p < players.size(); p++) {
+                distance = min(distance, max(abs(cell % map.width - players.x[p] / TILE_SIZE),
+                                             abs(cell / map.width - players.y[p] / TILE_SIZE)));
+            }
+            if (distance >= options.spawnMinDistance) candidates.push_back(cell);
+        }
+        // Cramped maps: settle for any free tile that doesn't overlap a player
+        if (candidates.empty()) {
+            for (int cell : spawnTiles.tiles) {
+                SDL_Rect tile = {cell % map.width * TILE_SIZE, cell / map.width * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+                bool clear = true;
+                for (int p = 0; p < players.size(); p++) clear &= !SDL_HasIntersection(&tile, &players.rect[p]);
+                if (clear) candidates.push_back(cell);
+            }
+        }
+        if (candidates.empty()) {
+            cerr << "No free tile to spawn enemies on" << endl;
+            return;
+        }
+        for (int i = 0; i < enemyNumber; i++) {
+            int cell = candidates[layoutRng() % candidates.size()];
+            int x = (cell % map.width) * TILE_SIZE;
+            int y = (cell / map.width) * TILE_SIZE;
+            enemies.insert(x, y);
+            EnemyBrain& mind = enemies.brain.back();
+            mind.rng = (Uint32)layoutRng() * 2654435761u | 1;
+            // Stagger first decisions and steps so tanks don't all act on the same tick
+            mind.nextThink = scheduler.tick + i % 12;
+            mind.moveDelay += i % 15;
+            mind.fireCooldown = options.enemyFireCooldown;
+        }
+    }
+
+    void resetObservation() {
+        observation.clear();
+        for (int w = 0; w < walls.size(); w++) {
+            if (walls.active[w]) {
+                observation.add(OBS_WALL, observation.cellAt(walls.rect[w].x, walls.rect[w].y, TILE_SIZE));
+            }
+        }
+        fill(players.obsCell.begin(), players.obsCell.end(), -1);
+        fill(enemies.obsCell.begin(), enemies.obsCell.end(), -1);
+        fill(bullets.obsCell.begin(), bullets.obsCell.end(), -1);
+        syncObservation();
+    }
+
+    // Moves only the entities whose tile changed; dead ones are dropped before they are erased
+    void syncObservation() {
+        syncTanks(OBS_PLAYER, players);
+        syncTanks(OBS_ENEMY, enemies);
+        int n = bullets.size();
+        for (int i = 0; i < n; i++) {
+            int channel = ObservationEncoder::bulletChannel(bullets, i);
+            if (bullets.active[i]) {
+                observation.place(channel, bullets.obsCell[i], bullets.x[i], bullets.y[i], BULLET_SIZE);
+            } else {
+                observation.take(channel, bullets.obsCell[i]);
+            }
+        }
+    }
+
+    void syncTanks(int channel, TankStore& tanks) {
+        int n = tanks.size();
+        for (int i = 0; i < n; i++) {
+            if (tanks.active[i]) {
+                observation.place(channel, tanks.obsCell[i], tanks.x[i], tanks.y[i], TILE_SIZE);
+            } else {
+                observation.take(channel, tanks.obsCell[i]);
+            }
+        }
+    }
+
+    const Uint8* observe() const {
+        return observation.data.data();
+    }
+
+#ifndef BATTLECITY_SERVER
+    void handleEvents() {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT) {
+                running = false;
+            }
+            else if (event.type == SDL_KEYDOWN) {
+                char action = actionForKey(event.key.keysym.sym);
+                if (action) applyAction(action);
+            }
+        }
+    }
+
+    static char actionForKey(SDL_Keycode key) {
+        switch (key) {
+            case SDLK_UP: return 'U';
+            case SDLK_DOWN: return 'D';
+            case SDLK_LEFT: return 'L';
+            case SDLK_RIGHT: return 'R';
+            case SDLK_SPACE: return 'S';
+        }
+        return 0;
+    }
+#endif
+
+    // The step a movement action takes; false for anything else
+    static bool actionStep(char action, int& dx, int& dy) {
+        dx = 0;
+        dy = 0;
+        switch (action) {
+            case 'U': dy = -5; return true;
+            case 'D': dy = 5; return true;
+            case 'L': dx = -5; return true;
+            case 'R': dx = 5; return true;
+        }
+        return false;
+    }
+
+    // Shot sound, silent while rollback replays ticks that were already heard once
+    void playShot(Team team) {
+#ifndef BATTLECITY_SERVER
+        Mix_Chunk* sound = team == TEAM_PLAYER ? playerShootSound : enemyShootSound;
+        if (sound && !resimulating) Mix_PlayChannel(-1, sound, 0);
+#endif
+    }
+
+    // One player input, from the keyboard, a replayed trace or a network client
+    void applyAction(char action, int slot = 0) {
+        if (!players.active[slot]) return;
+        int dx, dy;
+        switch (action) {
+            case 'U':
+            case 'D':
+            case 'L':
+            case 'R':
+                actionStep(action, dx, dy);
+                players.move(slot, dx, dy, walls, map);
+                break;
+            case 'S':
+                bullets.spawn(players.x[slot] + TILE_SIZE/2 - 5, players.y[slot] + TILE_SIZE/2 - 5,
+                              players.dirX[slot], players.dirY[slot], TEAM_PLAYER);
+                playShot(TEAM_PLAYER);
+                break;
+            default: return;
+        }
+        if (slot == 0 && !options.tracePath.empty()) tickActions += action;
+    }
+
+    void update() {
+        bullets.compact();
+        bullets.move(map);
+
+        // Update enemies
+        int hunted = target();
+        const SDL_Rect huntedRect = players.rect[hunted];
+        flowField.setTarget(map.tileIndex(players.x[hunted], players.y[hunted], TILE_SIZE));
+
+        // Read phase: tanks think against the walls, flow field and player, which stay untouched
+        scheduler.select(enemies);
+        // Only the tanks that decide are timed; pool dispatch, waiting and
+        // plain steps would otherwise count against the think budget
+        atomic<Uint64> deciding(0);
+        ai.parallelFor(enemies.size(), 64, [this, &huntedRect, &deciding](int begin, int end) {
+            Uint64 elapsed = 0;
+            for (int i = begin; i < end; i++) {
+                if (!enemies.active[i]) continue;
+                if (!enemies.brain[i].thinkNow) {
+                    enemies.think(i, map, walls, flowField, huntedRect);
+                    continue;
+                }
+                Uint64 start = SDL_GetPerformanceCounter();
+                enemies.think(i, map, walls, flowField, huntedRect);
+                elapsed += SDL_GetPerformanceCounter() - start;
+            }
+            if (elapsed) deciding += elapsed;
+        });
+        scheduler.record(deciding);
+
+        // Write phase in enemy order, so the result is the same for any thread count
+        int enemyCount = enemies.size();
+        for (int i = 0; i < enemyCount; i++) {
+            if (enemies.active[i]) {
+                enemies.applyMove(i);
+                if (enemies.brain[i].wantsShoot) {
+                    enemies.shoot(i, bullets);
+                    playShot(TEAM_ENEMY);
+                }
+            }
+        }
+
+        resolveCollisions();
+        syncObservation();
 
         // Check victory
-        enemies.erase(remove_if(enemies.begin(), enemies.end(),
-            [](EnemyTank& e) { return !e.active; }), enemies.end());
+        for (int i = enemies.size(); i-- > 0;) {
+            if (!enemies.active[i]) enemies.removeAt(i);
+        }
+
+        if (enemies.empty() && !options.endless) {
+            isVictory = true;
+            running = false;
+            endTime = SDL_GetTicks();
+        }
+
+        arenaAllocations += arena.allocations;
+        arena.reset();
+    }
+
+    void saveState(GameState& state) const {
+        state.walls = walls;
+        state.players = players;
+        state.enemies = enemies;
+        state.bullets = bullets;
+        state.observation = observation;
+        state.flowField = flowField;
+        state.spawnTiles = spawnTiles;
+        state.scheduler = scheduler;
+        state.wallHash = wallHash;
+        state.isGameOver = isGameOver;
+        state.isVictory = isVictory;
+        state.running = running;
+    }
+
+    void loadState(const GameState& state) {
+        walls = state.walls;
+        players = state.players;
+        enemies = state.enemies;
+        bullets = state.bullets;
+        observation = state.observation;
+        flowField = state.flowField;
+        spawnTiles = state.spawnTiles;
+        scheduler = state.scheduler;
+        wallHash = state.wallHash;
+        isGameOver = state.isGameOver;
+        isVictory = state.isVictory;
+        running = state.running;
+    }
+
+    // Walls are hashed incrementally; tanks and bullets change every tick, so
+    // they are folded in one pass each, in the order every peer stores them
+    void hashState(StateHash& hash) const {
+        hash.part[HASH_WALLS] = wallHash;
+        // One word per object: position in the low bits, the rest rotated in above
+        // them. Not collision-proof, but a real desync rarely changes only bits
+        // that cancel out.
+        WordChecksum playerHash;
+        for (int p = 0; p < players.size(); p++) {
+            Uint64 extra = (Uint64)(Uint8)players.dirX[p] << 16 | (Uint64)(Uint8)players.dirY[p] << 8 | players.active[p];
+            playerHash.add(((Uint64)(Uint32)players.x[p] << 32 | (Uint32)players.y[p]) ^ extra << 48);
+        }
+        hash.part[HASH_PLAYERS] = playerHash.finish();
+        WordChecksum enemyHash;
+        for (int e = 0; e < enemies.size(); e++) {
+            const EnemyBrain& mind = enemies.brain[e];
+            Uint64 extra = (Uint64)mind.rng << 8 | (Uint32)mind.heading << 1 | enemies.active[e];
+            enemyHash.add(((Uint64)(Uint32)enemies.x[e] << 32 | (Uint32)enemies.y[e]) ^ (extra << 44 | extra >> 20));
+        }
+        hash.part[HASH_ENEMIES] = enemyHash.finish();
+        WordChecksum bulletHash;
+        int n = bullets.size();
+        for (int i = 0; i < n; i++) {
+            if (!bullets.active[i]) continue;
+            Uint64 extra = (Uint64)(Uint8)bullets.dx[i] << 16 | (Uint64)(Uint8)bullets.dy[i] << 8 | bullets.team[i];
+            bulletHash.add(((Uint64)(Uint32)bullets.x[i] << 32 | (Uint32)bullets.y[i]) ^ extra << 40);
+        }
+        hash.part[HASH_BULLETS] = bulletHash.finish();
+    }
+
+    // Bullets against walls, enemies and the player; destroyed walls reopen their tiles
+    void resolveCollisions() {
+        FrameVector<int> destroyedWalls{ArenaAllocator<int>(arena)};
+        bool playerHit = false;
+        int bulletCount = bullets.size();
+        int wallCount = walls.size(), enemyCount = enemies.size(), playerCount = players.size();
+        for (int i = 0; i < bulletCount; i++) {
+            if (!bullets.active[i]) continue;
+            SDL_Rect bulletRect = bullets.rect(i);
+            if (bullets.team[i] == TEAM_PLAYER) {
+                for (int w = 0; w < wallCount; w++) {
+                    if (walls.active[w] && SDL_HasIntersection(&bulletRect, &walls.rect[w])) {
+                        walls.active[w] = 0;
+                        bullets.active[i] = 0;
+                        destroyedWalls.push_back(w);
+                    }
+                }
+                for (int e = 0; e < enemyCount; e++) {
+                    if (enemies.active[e] && SDL_HasIntersection(&bulletRect, &enemies.rect[e])) {
+                        enemies.active[e] = 0;
+                        bullets.active[i] = 0;
+                    }
+                }
+            } else if (!options.endless) {
+                // Check player hit; the match is lost once no player is left
+                for (int p = 0; p < playerCount; p++) {
+                    if (players.active[p] && SDL_HasIntersection(&bulletRect, &players.rect[p])) {
+                        players.active[p] = 0;
+                        bullets.active[i] = 0;
+                        playerHit = true;
+                    }
+                }
+            }
+        }
+        if (playerHit && !anyPlayerActive()) {
+            isGameOver = true;
+            running = false;
+            endTime = SDL_GetTicks();
+        }
+
+        for (int w : destroyedWalls) {
+            wallHash ^= mix64(w + 1);
+            observation.remove(OBS_WALL, observation.cellAt(walls.rect[w].x, walls.rect[w].y, TILE_SIZE));
+            int cell = map.tileIndex(walls.rect[w].x, walls.rect[w].y, TILE_SIZE);
+            flowField.openCell(cell);
+            if (inSpawnArea(cell)) spawnTiles.add(cell);
+        }
+    }
+
+#ifndef BATTLECITY_SERVER
+    void render() {
+        if (options.headless) {
+            if (!capture.due()) return;
+            capture.begin();
+            draw();
+            capture.end();
+            if (recorder.recording()) recorder.push(capture.frame.data());
+            return;
+        }
+        draw();
+        present();
+    }
+
+    void present() {
+        if (recorder.recording()) {
+            Uint8* slot = recorder.acquire();
+            if (slot && SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_RGBA32, slot, recorder.width * 4) == 0) {
+                recorder.publish();
+            }
+        }
+        SDL_RenderPresent(renderer);
+    }
+
+    void draw() {
+        snapshot(frame);
+        drawSnapshot(frame);
+    }
+
+    // Copies out what drawing needs; runs on the simulation side
+    void snapshot(RenderSnapshot& out) const {
+        out.screen = isVictory ? SCREEN_VICTORY : isGameOver ? SCREEN_GAME_OVER : SCREEN_PLAYING;
+        out.walls.resize(walls.size());
+        copy(walls.active.begin(), walls.active.end(), out.walls.begin());
+        out.players.clear();
+        out.playerFacing.clear();
+        for (int p = 0; p < players.size(); p++) {
+            if (!players.active[p]) continue;
+            out.players.push_back(players.rect[p]);
+            out.playerFacing.push_back(tankFacing(players.dirX[p], players.dirY[p]));
+        }
+        out.enemies.clear();
+        out.enemyFacing.clear();
+        for (int e = 0; e < enemies.size(); e++) {
+            if (!enemies.active[e]) continue;
+            out.enemies.push_back(enemies.rect[e]);
+            out.enemyFacing.push_back(tankFacing(enemies.dirX[e], enemies.dirY[e]));
+        }
+        out.bullets.clear();
+        bullets.appendRects(out.bullets);
+    }
+
+    // Reads nothing from the simulation but the fixed wall rectangles
+    void drawSnapshot(const RenderSnapshot& state) {
+        if (state.screen != SCREEN_PLAYING) {
+            SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
+            SDL_RenderClear(renderer);
+            SDL_Texture* endTexture = state.screen == SCREEN_VICTORY ? winTexture : gameOverTexture;
+            if (endTexture) {
+                SDL_RenderCopy(renderer, endTexture, NULL, NULL);
+            }
+            drawnValid = false;
+            return;
+        }
+
+        if (sceneTarget) setTarget(sceneTarget);
+        if (!partialRedraw) {
+            drawBackground(state);
+        } else if (!drawnValid || drawn.walls.size() != state.walls.size()) {
+            setTarget(backgroundCache);
+            drawBackground(state);
+            setTarget(sceneTarget);
+            // Also covers any letterbox bars, which partial frames never touch
+            SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, backgroundCache, NULL, NULL);
+        } else {
+            eraseMoved(state);
+        }
+
+        // Draw tanks, one batch per team
+        if (!tankSprites.texture || !tankSprites.draw(renderer, TEAM_PLAYER, state.players, state.playerFacing)) {
+            SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+            if (!state.players.empty()) SDL_RenderFillRects(renderer, state.players.data(), (int)state.players.size());
+        }
+        if (!tankSprites.texture || !tankSprites.draw(renderer, TEAM_ENEMY, state.enemies, state.enemyFacing)) {
+            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+            if (!state.enemies.empty()) SDL_RenderFillRects(renderer, state.enemies.data(), (int)state.enemies.size());
+        }
+
+        // Draw bullets
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        if (!state.bullets.empty()) SDL_RenderFillRects(renderer, state.bullets.data(), (int)state.bullets.size());
+
+        if (partialRedraw) {
+            drawn.walls = state.walls;
+            drawn.players = state.players;
+            drawn.enemies = state.enemies;
+            drawn.bullets = state.bullets;
+            drawnValid = true;
+        }
+
+        if (sceneTarget) {
+            setTarget(NULL);
+            SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, sceneTarget, NULL, NULL);
+        }
+    }
+
+    // Textures at scene size are drawn in logical coordinates like the screen
+    void setTarget(SDL_Texture* texture) {
+        SDL_SetRenderTarget(renderer, texture);
+        if (texture && sceneTarget) SDL_RenderSetScale(renderer, sceneScaleX, sceneScaleY);
+    }
+
+    void drawBackground(const RenderSnapshot& state) {
+        SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
+        SDL_RenderClear(renderer);
+
+        // Draw game board
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        for (int i = 1; i < map.height - 1; i++) {
+            for (int j = 1; j < map.width - 1; j++) {
+                SDL_Rect tile = {j * TILE_SIZE, i * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+                SDL_RenderFillRect(renderer, &tile);
+            }
+        }
+
+        // Draw walls
+        for (size_t w = 0; w < state.walls.size(); w++) {
+            if (state.walls[w]) SDL_RenderCopy(renderer, wallTexture, NULL, &walls.rect[w]);
+        }
+    }
+
+    // Puts the cached background back under everything drawn last frame and
+    // under this frame's entities, after patching walls that fell (or stood
+    // back up after a rollback) into the cache
+    void eraseMoved(const RenderSnapshot& state) {
+        dirty.clear();
+        bool targetSet = false;
+        for (size_t w = 0; w < state.walls.size(); w++) {
+            if (state.walls[w] == drawn.walls[w]) continue;
+            if (!targetSet) {
+                setTarget(backgroundCache);
+                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+                targetSet = true;
+            }
+            SDL_RenderFillRect(renderer, &walls.rect[w]);
+            if (state.walls[w]) SDL_RenderCopy(renderer, wallTexture, NULL, &walls.rect[w]);
+            dirty.mark(walls.rect[w]);
+        }
+        if (targetSet) setTarget(sceneTarget);
+        dirty.mark(drawn.players);
+        dirty.mark(drawn.enemies);
+        dirty.mark(drawn.bullets);
+        dirty.mark(state.players);
+        dirty.mark(state.enemies);
+        dirty.mark(state.bullets);
+
+        // Scaled output can round a tile edge differently from the sprite it
+        // covered, and past about half the screen one copy is cheaper anyway
+        float scaleX, scaleY;
+        SDL_RenderGetScale(renderer, &scaleX, &scaleY);
+        if (dirty.coverage() > 0.5 || scaleX != floorf(scaleX) || scaleY != floorf(scaleY)) {
+            SDL_RenderCopy(renderer, backgroundCache, NULL, NULL);
+            return;
+        }
+        for (const SDL_Rect& r : dirty.merge()) SDL_RenderCopy(renderer, backgroundCache, &r, &r);
+    }
+
+    // Fixed 60 Hz ticks on their own thread. Input arrives through pendingInput
+    // and every finished tick is published to frames, so nothing here ever
+    // waits on the window, vsync or the GPU.
+    void simulate() {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        Uint64 period = (Uint64)(freq / 60);
+        Uint64 next = SDL_GetPerformanceCounter();
+        Uint32 tick = 0;
+        string actions;
+        while (running) {
+            if (quitRequested) {
+                running = false;
+                break;
+            }
+            {
+                lock_guard<mutex> lock(inputMutex);
+                actions.swap(pendingInput);
+            }
+            for (char action : actions) applyAction(action);
+            actions.clear();
+            if (!options.tracePath.empty()) {
+                trace.ticks.push_back(tickActions);
+                tickActions.clear();
+            }
+            update();
+            RenderSnapshot& out = frames.writeSlot();
+            snapshot(out);
+            out.tick = ++tick;
+            frames.publish();
+
+            next += period;
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (now < next) {
+                SDL_Delay((Uint32)((next - now) * 1000 / freq));
+            } else if (now > next + period * 4) {
+                // Don't try to catch up after a long stall
+                next = now;
+            }
+        }
+        simulationDone = true;
+    }
+
+    void run() {
+        thread simulation(&Game::simulate, this);
+        // SDL wants events and rendering on the thread that made the window
+        while (!simulationDone) {
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                if (event.type == SDL_QUIT) {
+                    quitRequested = true;
+                } else if (event.type == SDL_WINDOWEVENT || event.type == SDL_RENDER_TARGETS_RESET) {
+                    // Exposed windows and reset render targets may have lost their pixels
+                    drawnValid = false;
+                } else if (event.type == SDL_KEYDOWN) {
+                    char action = actionForKey(event.key.keysym.sym);
+                    if (action) {
+                        lock_guard<mutex> lock(inputMutex);
+                        pendingInput += action;
+                    }
+                }
+            }
+            if (frames.acquire()) {
+                drawSnapshot(frames.readSlot());
+                present();
+            } else {
+                SDL_Delay(1);
+            }
+        }
+        simulation.join();
+        if (!options.tracePath.empty() && !trace.save(options.tracePath)) {
+            cerr << "Failed to write match trace " << options.tracePath << endl;
+        }
+        showEndScreen();
+    }
+
+    // Show end screen for 3 seconds
+    void showEndScreen() {
+        if (isVictory || isGameOver) {
+            Uint32 startTime = SDL_GetTicks();
+            while (SDL_GetTicks() - startTime < 3000) {
+                render();
+                SDL_Delay(16);
+            }
+        }
+    }
+
+    // Simulates as fast as possible with no window, audio or input. False
+    // if counting allocations found any after warmup.
+    bool runHeadless(int ticks) {
+        int ticksRun = 0;
+#ifdef COUNT_ALLOCATIONS
+        // The first ticks still size the bullet arrays and arena blocks
+        const int warmup = 60;
+        size_t heapBefore = 0;
+#endif
+        for (int i = 0; i < ticks && running; i++) {
+#ifdef COUNT_ALLOCATIONS
+            if (i == warmup) heapBefore = heapAllocations;
+#endif
+            update();
+            render();
+            ticksRun++;
+        }
+        capture.report();
+        cout << "Frame arena: " << (ticksRun ? arenaAllocations / ticksRun : 0) << " allocations/tick, peak "
+             << arena.peakBytes << " bytes in " << arena.blocks.size() << " block(s)" << endl;
+#ifdef COUNT_ALLOCATIONS
+        if (ticksRun > warmup) {
+            cout << "Heap allocations after warmup: " << (heapAllocations - heapBefore) << " over "
+                 << (ticksRun - warmup) << " ticks" << endl;
+            if (heapAllocations != heapBefore) {
+                cerr << "Steady-state ticks must not allocate" << endl;
+                return false;
+            }
+        }
+#endif
+        return true;
+    }
+
+    // Runs flat out, timing every tick (update plus render)
+    StressResult runStress(int ticks) {
+        StressResult result = {0, 0, 0, 0, 0};
+        double freq = (double)SDL_GetPerformanceFrequency();
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < ticks && running; i++) {
+            Uint64 tickStart = SDL_GetPerformanceCounter();
+            if (!options.headless) handleEvents();
+            update();
+            render();
+            double ms = (SDL_GetPerformanceCounter() - tickStart) * 1000.0 / freq;
+            result.maxMs = max(result.maxMs, ms);
+            result.ticks++;
+        }
+        double seconds = (SDL_GetPerformanceCounter() - start) / freq;
+        result.ticksPerSecond = seconds > 0 ? result.ticks / seconds : 0;
+        result.averageMs = result.ticks ? seconds * 1000.0 / result.ticks : 0;
+        result.peakMemory = peakMemoryBytes();
+        return result;
+    }
+
+    // Feeds a recorded match through update() and render(), timing each tick
+    void runReplay(const MatchTrace& match, vector<double>& frameMs) {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        for (size_t i = 0; i < match.ticks.size() && running; i++) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (char action : match.ticks[i]) applyAction(action);
+            update();
+            render();
+            frameMs.push_back((SDL_GetPerformanceCounter() - start) * 1000.0 / freq);
+        }
+    }
+
+    ~Game() {
+        recorder.stop();
+        if (wallTexture) SDL_DestroyTexture(wallTexture);
+        if (winTexture) SDL_DestroyTexture(winTexture);
+        if (gameOverTexture) SDL_DestroyTexture(gameOverTexture);
+        if (backgroundCache) SDL_DestroyTexture(backgroundCache);
+        if (sceneTarget) SDL_DestroyTexture(sceneTarget);
+        tankSprites.destroy();
+        if (options.headless) return;
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        Mix_FreeChunk(playerShootSound);
+        Mix_FreeChunk(enemyShootSound);
+        Mix_FreeMusic(backgroundMusic);
+        Mix_CloseAudio();
+    }
+#endif
+};
+
+// UDP transport for networked matches: IPv4, non-blocking, polled from the tick loops
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+typedef int SocketLength;
+const SocketHandle NO_SOCKET = INVALID_SOCKET;
+#else
+typedef int SocketHandle;
+typedef socklen_t SocketLength;
+const SocketHandle NO_SOCKET = -1;
+#endif
+
+const Uint16 NET_DEFAULT_PORT = 40400;
+// Loopback carries datagrams up to 64 KiB; snapshots are trimmed to fit
+const int NET_MAX_PACKET = 60000;
+const Uint8 NET_VERSION = 2;
+
+class UdpSocket {
+public:
+    SocketHandle handle;
+
+    UdpSocket() {
+        handle = NO_SOCKET;
+    }
+
+    ~UdpSocket() {
+        close();
+    }
+
+    // Port 0 binds an ephemeral port, which is what clients want. With sharePort
+    // several sockets bind the same port and the kernel spreads senders across
+    // them, where the platform supports it.
+    bool open(Uint16 port, bool sharePort = false) {
+#ifdef _WIN32
+        static bool started = false;
+        if (!started) {
+            WSADATA data;
+            if (WSAStartup(MAKEWORD(2, 2), &data) != 0) return false;
+            started = true;
+        }
+#endif
+        handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (handle == NO_SOCKET) return false;
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+#ifdef SO_REUSEPORT
+        int share = 1;
+        if (sharePort) setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, (const char*)&share, sizeof(share));
+#else
+        (void)sharePort;
+#endif
+        if (bind(handle, (sockaddr*)&address, sizeof(address)) != 0) {
+            close();
+            return false;
+        }
+#ifdef _WIN32
+        u_long nonBlocking = 1;
+        ioctlsocket(handle, FIONBIO, &nonBlocking);
+#else
+        fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        return true;
+    }
+
+    void close() {
+        if (handle == NO_SOCKET) return;
+#ifdef _WIN32
+        closesocket(handle);
+#else
+        ::close(handle);
+#endif
+        handle = NO_SOCKET;
+    }
+
+    bool send(const sockaddr_in& to, const vector<Uint8>& packet) {
+        return sendto(handle, (const char*)packet.data(), (int)packet.size(), 0,
+                      (const sockaddr*)&to, sizeof(to)) == (int)packet.size();
+    }
+
+    // Size of the datagram read, or -1 when nothing is waiting
+    int receive(sockaddr_in& from, Uint8* buffer, int capacity) {
+        SocketLength length = sizeof(from);
+        return (int)recvfrom(handle, (char*)buffer, capacity, 0, (sockaddr*)&from, &length);
+    }
+
+    Uint16 localPort() const {
+        sockaddr_in address;
+        SocketLength length = sizeof(address);
+        if (getsockname(handle, (sockaddr*)&address, &length) != 0) return 0;
+        return ntohs(address.sin_port);
+    }
+
+    // Sleeps until a datagram arrives or the timeout passes
+    void wait(int timeoutUs) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(handle, &readable);
+        timeval timeout = {timeoutUs / 1000000, timeoutUs % 1000000};
+        select((int)handle + 1, &readable, NULL, NULL, &timeout);
+    }
+};
+
+bool sameAddress(const sockaddr_in& a, const sockaddr_in& b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+Uint64 addressKey(const sockaddr_in& address) {
+    return (Uint64)address.sin_addr.s_addr << 16 | address.sin_port;
+}
+
+// "host:port" or "host"; only dotted IPv4 and localhost are understood
+bool parseAddress(const string& text, sockaddr_in& address) {
+    string host = text;
+    int port = NET_DEFAULT_PORT;
+    size_t colon = text.find(':');
+    if (colon != string::npos) {
+        host = text.substr(0, colon);
+        port = atoi(text.c_str() + colon + 1);
+    }
+    if (host.empty() || host == "localhost") host = "127.0.0.1";
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((Uint16)port);
+    address.sin_addr.s_addr = inet_addr(host.c_str());
+    return address.sin_addr.s_addr != INADDR_NONE && port > 0 && port < 65536;
+}
+
+// Little-endian packet encoding shared by client and server
+class PacketWriter {
+public:
+    vector<Uint8> data;
+
+    void clear() {
+        data.clear();
+    }
+
+    int size() const {
+        return (int)data.size();
+    }
+
+    void u8(Uint8 value) {
+        data.push_back(value);
+    }
+
+    void u16(Uint16 value) {
+        u8(value & 0xFF);
+        u8(value >> 8);
+    }
+
+    void u32(Uint32 value) {
+        u16(value & 0xFFFF);
+        u16(value >> 16);
+    }
+
+    void i32(int value) {
+        u32((Uint32)value);
+    }
+
+    // 7 bits per byte, high bit set while more follow
+    void varint(Uint32 value) {
+        while (value >= 0x80) {
+            u8((Uint8)(value | 0x80));
+            value >>= 7;
+        }
+        u8((Uint8)value);
+    }
+
+    // Zigzag first so small negative numbers stay short
+    void svarint(int value) {
+        varint(((Uint32)value << 1) ^ (Uint32)(value >> 31));
+    }
+};
+
+// Reads past the end return 0 and clear ok, so callers check once at the end
+class PacketReader {
+public:
+    const Uint8* data;
+    int size;
+    int pos;
+    bool ok;
+
+    PacketReader(const Uint8* bytes, int length) {
+        data = bytes;
+        size = length;
+        pos = 0;
+        ok = true;
+    }
+
+    Uint8 u8() {
+        if (pos >= size) {
+            ok = false;
+            return 0;
+        }
+        return data[pos++];
+    }
+
+    Uint16 u16() {
+        Uint16 low = u8();
+        return low | (Uint16)(u8() << 8);
+    }
+
+    Uint32 u32() {
+        Uint32 low = u16();
+        return low | ((Uint32)u16() << 16);
+    }
+
+    int i32() {
+        return (int)u32();
+    }
+
+    Uint32 varint() {
+        Uint32 value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            Uint8 byte = u8();
+            value |= (Uint32)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    int svarint() {
+        Uint32 value = varint();
+        return (int)(value >> 1) ^ -(int)(value & 1);
+    }
+};
+
+enum NetMessage {
+    NET_JOIN = 1,     // client -> server: protocol version
+    NET_WELCOME,      // server -> client: slot, match setup
+    NET_FULL,         // server -> client: every slot is taken
+    NET_INPUT,        // client -> server: slot, sequence, actions since the last input
+    NET_SNAPSHOT,     // server -> client: state after a tick
+    NET_LEAVE,        // client -> server: slot
+    NET_PEER_INPUT    // peer -> peer: slot, acked tick, first tick, actions per tick
+};
+
+// Everything a client needs to build the same map the server runs
+void writeSetup(PacketWriter& packet, const GameOptions& options) {
+    packet.u32(options.seed);
+    packet.u16((Uint16)options.mapWidth);
+    packet.u16((Uint16)options.mapHeight);
+    packet.u32((Uint32)options.enemyCount);
+    packet.i32(options.wallThreshold);
+    packet.u16((Uint16)options.enemyFireCooldown);
+    packet.u8((Uint8)options.spawnMinDistance);
+    packet.u8((Uint8)options.playerCount);
+    packet.u8(options.endless ? 1 : 0);
+}
+
+void readSetup(PacketReader& packet, GameOptions& options) {
+    options.seed = packet.u32();
+    options.mapWidth = packet.u16();
+    options.mapHeight = packet.u16();
+    options.enemyCount = (int)packet.u32();
+    options.wallThreshold = packet.i32();
+    options.enemyFireCooldown = packet.u16();
+    options.spawnMinDistance = packet.u8();
+    options.playerCount = packet.u8();
+    options.endless = packet.u8() != 0;
+}
+
+struct PlayerState {
+    Uint8 active;
+    int x, y;
+    int dirX, dirY;
+    // Last input sequence the server applied for this slot
+    Uint32 ack;
+};
+
+struct EnemyState {
+    Uint32 id;
+    int x, y;
+};
+
+struct BulletState {
+    Uint32 id;
+    int x, y;
+    int dx, dy;
+    Uint8 team;
+};
+
+// What a client sees of the match after one tick. Enemies and bullets are keyed
+// by serial number and kept sorted by id, so two snapshots can be diffed in one
+// merge pass.
+class Snapshot {
+public:
+    Uint32 tick;
+    Uint8 flags;
+    vector<PlayerState> players;
+    vector<Uint8> walls;
+    vector<EnemyState> enemies;
+    vector<BulletState> bullets;
+
+    Snapshot() {
+        tick = 0;
+        flags = 0;
+    }
+
+    // The state both sides know without being told: every wall standing, nothing moving
+    void reset(const Game& game) {
+        tick = 0;
+        flags = 0;
+        players.assign(game.players.size(), PlayerState());
+        for (auto& player : players) player = {0, 0, 0, 0, 0, 0};
+        walls.assign(game.walls.size(), 1);
+        enemies.clear();
+        bullets.clear();
+    }
+
+    void capture(const Game& game, Uint32 atTick, const vector<Uint32>& acks) {
+        tick = atTick;
+        flags = (game.isGameOver ? 1 : 0) | (game.isVictory ? 2 : 0);
+        players.resize(game.players.size());
+        const TankStore& tanks = game.players;
+        for (size_t i = 0; i < players.size(); i++) {
+            players[i] = {tanks.active[i], tanks.x[i], tanks.y[i], tanks.dirX[i], tanks.dirY[i], i < acks.size() ? acks[i] : 0};
+        }
+        walls = game.walls.active;
+        enemies.clear();
+        for (int i = 0; i < game.enemies.size(); i++) {
+            if (!game.enemies.active[i]) continue;
+            enemies.push_back({game.enemies.serial[i], game.enemies.x[i], game.enemies.y[i]});
+        }
+        sort(enemies.begin(), enemies.end(), [](const EnemyState& a, const EnemyState& b) { return a.id < b.id; });
+        // Bullet ids only grow and compaction keeps order, so these are already sorted
+        bullets.clear();
+        for (int i = 0; i < game.bullets.size(); i++) {
+            if (!game.bullets.active[i]) continue;
+            bullets.push_back({game.bullets.id[i], game.bullets.x[i], game.bullets.y[i],
+                               game.bullets.dx[i], game.bullets.dy[i], game.bullets.team[i]});
+        }
+    }
+
+    void apply(Game& game) const {
+        TankStore& tanks = game.players;
+        for (int i = 0; i < (int)players.size() && i < tanks.size(); i++) {
+            tanks.active[i] = players[i].active != 0;
+            tanks.place(i, players[i].x, players[i].y);
+            tanks.dirX[i] = players[i].dirX;
+            tanks.dirY[i] = players[i].dirY;
+        }
+        for (int w = 0; w < (int)walls.size() && w < game.walls.size(); w++) game.walls.active[w] = walls[w] != 0;
+        game.enemies.clear();
+        for (const auto& enemy : enemies) {
+            game.enemies.insert(enemy.x, enemy.y);
+            game.enemies.serial.back() = enemy.id;
+        }
+        game.bullets.clear();
+        for (const auto& bullet : bullets) {
+            game.bullets.spawn(bullet.x, bullet.y, 0, 0, (Team)bullet.team);
+            game.bullets.dx.back() = bullet.dx;
+            game.bullets.dy.back() = bullet.dy;
+        }
+        game.isGameOver = (flags & 1) != 0;
+        game.isVictory = (flags & 2) != 0;
+        if (game.isGameOver || game.isVictory) game.running = false;
+    }
+};
+
+// Bytes the first network version spent on a snapshot: fixed-width fields for
+// every player, enemy and bullet plus one bit per wall
+int fullSnapshotSize(const Snapshot& snapshot) {
+    return 10 + (int)snapshot.players.size() * 15 + 4 + ((int)snapshot.walls.size() + 7) / 8 +
+           4 + (int)snapshot.enemies.size() * 8 + 4 + (int)snapshot.bullets.size() * 11;
+}
+
+bool sameSnapshot(const Snapshot& a, const Snapshot& b) {
+    if (a.tick != b.tick || a.flags != b.flags || a.walls != b.walls || a.players.size() != b.players.size() ||
+        a.enemies.size() != b.enemies.size() || a.bullets.size() != b.bullets.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.players.size(); i++) {
+        const PlayerState& p = a.players[i];
+        const PlayerState& q = b.players[i];
+        if (p.active != q.active || p.x != q.x || p.y != q.y || p.dirX != q.dirX || p.dirY != q.dirY || p.ack != q.ack) return false;
+    }
+    for (size_t i = 0; i < a.enemies.size(); i++) {
+        if (a.enemies[i].id != b.enemies[i].id || a.enemies[i].x != b.enemies[i].x || a.enemies[i].y != b.enemies[i].y) return false;
+    }
+    for (size_t i = 0; i < a.bullets.size(); i++) {
+        const BulletState& p = a.bullets[i];
+        const BulletState& q = b.bullets[i];
+        if (p.id != q.id || p.x != q.x || p.y != q.y || p.dx != q.dx || p.dy != q.dy || p.team != q.team) return false;
+    }
+    return true;
+}
+
+// Sorted ids as a count and the gaps between them
+void writeIds(PacketWriter& packet, const vector<Uint32>& ids) {
+    packet.varint((Uint32)ids.size());
+    Uint32 previous = 0;
+    for (Uint32 id : ids) {
+        packet.varint(id - previous);
+        previous = id;
+    }
+}
+
+// A tank's move since base. Tanks move along one axis at a time, so the axis goes
+// in the low two bits of the first varint and a short step fits one byte.
+void writeStep(PacketWriter& packet, int dx, int dy) {
+    if (dy == 0) {
+        packet.varint((((Uint32)dx << 1) ^ (Uint32)(dx >> 31)) << 2 | 1);
+    } else if (dx == 0) {
+        packet.varint((((Uint32)dy << 1) ^ (Uint32)(dy >> 31)) << 2 | 2);
+    } else {
+        packet.varint((((Uint32)dx << 1) ^ (Uint32)(dx >> 31)) << 2 | 3);
+        packet.svarint(dy);
+    }
+}
+
+bool readStep(PacketReader& packet, int& dx, int& dy) {
+    Uint32 value = packet.varint();
+    int step = (int)(value >> 3) ^ -(int)((value >> 2) & 1);
+    dx = 0;
+    dy = 0;
+    switch (value & 3) {
+        case 1: dx = step; break;
+        case 2: dy = step; break;
+        case 3: dx = step; dy = packet.svarint(); break;
+        default: return false;
+    }
+    return packet.ok;
+}
+
+// Encodes current against base, which the client already holds: wall bits that
+// flipped, player fields that changed, enemies that moved, appeared or left,
+// and bullets that appeared, left or strayed from the straight line predicted
+// from base. Ids are gap-coded, enemy moves use writeStep and all numbers are
+// varints.
+void writeDelta(PacketWriter& packet, const Snapshot& base, const Snapshot& current, vector<Uint32>& scratch) {
+    packet.u8(NET_SNAPSHOT);
+    packet.varint(current.tick);
+    packet.varint(base.tick);
+    packet.u8(current.flags);
+
+    packet.varint((Uint32)current.players.size());
+    for (size_t i = 0; i < current.players.size(); i++) {
+        const PlayerState& now = current.players[i];
+        PlayerState was = i < base.players.size() ? base.players[i] : PlayerState{0, 0, 0, 0, 0, 0};
+        Uint8 changed = (now.active != was.active ? 1 : 0) | (now.x != was.x || now.y != was.y ? 2 : 0) |
+                        (now.dirX != was.dirX || now.dirY != was.dirY ? 4 : 0) | (now.ack != was.ack ? 8 : 0);
+        packet.u8(changed);
+        if (changed & 1) packet.u8(now.active);
+        if (changed & 2) {
+            packet.svarint(now.x - was.x);
+            packet.svarint(now.y - was.y);
+        }
+        if (changed & 4) {
+            packet.svarint(now.dirX);
+            packet.svarint(now.dirY);
+        }
+        if (changed & 8) packet.svarint((int)(now.ack - was.ack));
+    }
+
+    scratch.clear();
+    for (size_t w = 0; w < current.walls.size(); w++) {
+        if (w >= base.walls.size() || current.walls[w] != base.walls[w]) scratch.push_back((Uint32)w + 1);
+    }
+    writeIds(packet, scratch);
+
+    // Enemies: ids that left, then ids that are new (absolute) or moved (relative)
+    scratch.clear();
+    size_t b = 0;
+    for (const auto& enemy : current.enemies) {
+        while (b < base.enemies.size() && base.enemies[b].id < enemy.id) scratch.push_back(base.enemies[b++].id);
+        if (b < base.enemies.size() && base.enemies[b].id == enemy.id) b++;
+    }
+    while (b < base.enemies.size()) scratch.push_back(base.enemies[b++].id);
+    writeIds(packet, scratch);
+    scratch.clear();
+    b = 0;
+    for (size_t i = 0; i < current.enemies.size(); i++) {
+        const EnemyState& enemy = current.enemies[i];
+        while (b < base.enemies.size() && base.enemies[b].id < enemy.id) b++;
+        bool known = b < base.enemies.size() && base.enemies[b].id == enemy.id;
+        if (!known || base.enemies[b].x != enemy.x || base.enemies[b].y != enemy.y) scratch.push_back((Uint32)i);
+    }
+    packet.varint((Uint32)scratch.size());
+    Uint32 previous = 0;
+    b = 0;
+    for (Uint32 i : scratch) {
+        const EnemyState& enemy = current.enemies[i];
+        packet.varint(enemy.id - previous);
+        previous = enemy.id;
+        while (b < base.enemies.size() && base.enemies[b].id < enemy.id) b++;
+        if (b < base.enemies.size() && base.enemies[b].id == enemy.id) {
+            writeStep(packet, enemy.x - base.enemies[b].x, enemy.y - base.enemies[b].y);
+        } else {
+            packet.svarint(enemy.x);
+            packet.svarint(enemy.y);
+        }
+    }
+
+    // Bullets fly straight: one move per tick since base
+    int elapsed = (int)(current.tick - base.tick);
+    scratch.clear();
+    b = 0;
+    for (const auto& bullet : current.bullets) {
+        while (b < base.bullets.size() && base.bullets[b].id < bullet.id) scratch.push_back(base.bullets[b++].id);
+        if (b < base.bullets.size() && base.bullets[b].id == bullet.id) b++;
+    }
+    while (b < base.bullets.size()) scratch.push_back(base.bullets[b++].id);
+    writeIds(packet, scratch);
+    scratch.clear();
+    b = 0;
+    for (size_t i = 0; i < current.bullets.size(); i++) {
+        const BulletState& bullet = current.bullets[i];
+        while (b < base.bullets.size() && base.bullets[b].id < bullet.id) b++;
+        bool known = b < base.bullets.size() && base.bullets[b].id == bullet.id;
+        if (!known || base.bullets[b].x + base.bullets[b].dx * elapsed != bullet.x ||
+            base.bullets[b].y + base.bullets[b].dy * elapsed != bullet.y) {
+            scratch.push_back((Uint32)i);
+        }
+    }
+    packet.varint((Uint32)scratch.size());
+    previous = 0;
+    b = 0;
+    for (Uint32 i : scratch) {
+        const BulletState& bullet = current.bullets[i];
+        packet.varint(bullet.id - previous);
+        previous = bullet.id;
+        while (b < base.bullets.size() && base.bullets[b].id < bullet.id) b++;
+        if (b < base.bullets.size() && base.bullets[b].id == bullet.id) {
+            packet.svarint(bullet.x - (base.bullets[b].x + base.bullets[b].dx * elapsed));
+            packet.svarint(bullet.y - (base.bullets[b].y + base.bullets[b].dy * elapsed));
+        } else {
+            packet.svarint(bullet.x);
+            packet.svarint(bullet.y);
+            packet.svarint(bullet.dx);
+            packet.svarint(bullet.dy);
+            packet.u8(bullet.team);
+        }
+    }
+}
+
+bool readIds(PacketReader& packet, vector<Uint32>& ids) {
+    Uint32 count = packet.varint();
+    if (!packet.ok || count > (Uint32)packet.size) return false;
+    ids.clear();
+    Uint32 id = 0;
+    for (Uint32 i = 0; i < count && packet.ok; i++) {
+        id += packet.varint();
+        ids.push_back(id);
+    }
+    return packet.ok;
+}
+
+// Rebuilds current from base and a packet positioned after the base tick
+bool readDelta(PacketReader& packet, const Snapshot& base, Uint32 tick, Snapshot& current, vector<Uint32>& scratch) {
+    current.tick = tick;
+    current.flags = packet.u8();
+
+    Uint32 playerCount = packet.varint();
+    if (!packet.ok || playerCount > 255) return false;
+    current.players.resize(playerCount);
+    for (Uint32 i = 0; i < playerCount; i++) {
+        PlayerState now = i < base.players.size() ? base.players[i] : PlayerState{0, 0, 0, 0, 0, 0};
+        Uint8 changed = packet.u8();
+        if (changed & 1) now.active = packet.u8();
+        if (changed & 2) {
+            now.x += packet.svarint();
+            now.y += packet.svarint();
+        }
+        if (changed & 4) {
+            now.dirX = packet.svarint();
+            now.dirY = packet.svarint();
+        }
+        if (changed & 8) now.ack += (Uint32)packet.svarint();
+        current.players[i] = now;
+    }
+
+    if (!readIds(packet, scratch)) return false;
+    current.walls = base.walls;
+    for (Uint32 w : scratch) {
+        if (w == 0 || w > current.walls.size()) return false;
+        current.walls[w - 1] ^= 1;
+    }
+
+    // Enemies: drop the ids that left, then merge in the new and moved ones
+    if (!readIds(packet, scratch)) return false;
+    current.enemies.clear();
+    size_t r = 0;
+    for (const auto& enemy : base.enemies) {
+        while (r < scratch.size() && scratch[r] < enemy.id) r++;
+        if (r < scratch.size() && scratch[r] == enemy.id) continue;
+        current.enemies.push_back(enemy);
+    }
+    Uint32 changedCount = packet.varint();
+    if (!packet.ok || changedCount > (Uint32)packet.size) return false;
+    size_t kept = current.enemies.size(), k = 0;
+    Uint32 id = 0;
+    for (Uint32 i = 0; i < changedCount && packet.ok; i++) {
+        id += packet.varint();
+        while (k < kept && current.enemies[k].id < id) k++;
+        if (k < kept && current.enemies[k].id == id) {
+            int dx, dy;
+            if (!readStep(packet, dx, dy)) return false;
+            current.enemies[k].x += dx;
+            current.enemies[k].y += dy;
+        } else {
+            int x = packet.svarint();
+            current.enemies.push_back({id, x, packet.svarint()});
+        }
+    }
+    sort(current.enemies.begin(), current.enemies.end(), [](const EnemyState& a, const EnemyState& b) { return a.id < b.id; });
+
+    int elapsed = (int)(tick - base.tick);
+    if (!readIds(packet, scratch)) return false;
+    current.bullets.clear();
+    r = 0;
+    for (const auto& bullet : base.bullets) {
+        while (r < scratch.size() && scratch[r] < bullet.id) r++;
+        if (r < scratch.size() && scratch[r] == bullet.id) continue;
+        BulletState moved = bullet;
+        moved.x += bullet.dx * elapsed;
+        moved.y += bullet.dy * elapsed;
+        current.bullets.push_back(moved);
+    }
+    changedCount = packet.varint();
+    if (!packet.ok || changedCount > (Uint32)packet.size) return false;
+    kept = current.bullets.size();
+    k = 0;
+    id = 0;
+    for (Uint32 i = 0; i < changedCount && packet.ok; i++) {
+        id += packet.varint();
+        while (k < kept && current.bullets[k].id < id) k++;
+        int x = packet.svarint(), y = packet.svarint();
+        if (k < kept && current.bullets[k].id == id) {
+            current.bullets[k].x += x;
+            current.bullets[k].y += y;
+        } else {
+            BulletState bullet = {id, x, y, 0, 0, 0};
+            bullet.dx = packet.svarint();
+            bullet.dy = packet.svarint();
+            bullet.team = packet.u8();
+            current.bullets.push_back(bullet);
+        }
+    }
+    sort(current.bullets.begin(), current.bullets.end(), [](const BulletState& a, const BulletState& b) { return a.id < b.id; });
+    return packet.ok;
+}
+
+// Snapshots by tick for the last SNAPSHOT_HISTORY ticks; older baselines are gone
+const int SNAPSHOT_HISTORY = 64;
+
+class SnapshotHistory {
+public:
+    Snapshot initial;
+    vector<Snapshot> ring;
+
+    SnapshotHistory() : ring(SNAPSHOT_HISTORY) {
+    }
+
+    void reset(const Game& game) {
+        initial.reset(game);
+        for (auto& snapshot : ring) snapshot.tick = 0;
+    }
+
+    Snapshot& slot(Uint32 tick) {
+        return ring[tick % SNAPSHOT_HISTORY];
+    }
+
+    // Tick 0 is the match start both sides can build on their own
+    const Snapshot* find(Uint32 tick) const {
+        if (tick == 0) return &initial;
+        const Snapshot& snapshot = ring[tick % SNAPSHOT_HISTORY];
+        return snapshot.tick == tick ? &snapshot : NULL;
+    }
+};
+
+// Authoritative match. The server owns the only simulated Game: each tick it
+// applies the actions clients sent since the previous tick, steps the match and
+// sends every client the resulting state. Each player slot is one client.
+class NetServer {
+public:
+    struct Client {
+        sockaddr_in address;
+        bool connected;
+        // Highest input sequence applied, echoed back in snapshots
+        Uint32 lastSequence;
+        string pending;
+        Uint32 lastHeard;
+        // Newest snapshot the client has confirmed; deltas are encoded against it
+        Uint32 ackedTick;
+    };
+
+    UdpSocket ownSocket;
+    // ownSocket, or one shared by every match a dedicated server hosts
+    UdpSocket* socket;
+    Game* game;
+    vector<Client> clients;
+    vector<SDL_Point> spawns;
+    vector<Uint32> acks;
+    SnapshotHistory history;
+    vector<Uint32> scratch;
+    PacketWriter packet;
+    vector<Uint8> buffer;
+    Uint32 tick;
+    int tickRate;
+    size_t bytesSent;
+    size_t bytesReceived;
+    size_t snapshotsSent;
+    size_t snapshotBytes;
+    size_t fullSnapshotBytes;
+
+    NetServer() {
+        socket = &ownSocket;
+        game = NULL;
+        tick = 0;
+        tickRate = 60;
+        bytesSent = 0;
+        bytesReceived = 0;
+        snapshotsSent = 0;
+        snapshotBytes = 0;
+        fullSnapshotBytes = 0;
+        buffer.resize(65536);
+    }
+
+    bool start(Uint16 port, GameOptions options) {
+        if (!ownSocket.open(port)) {
+            cerr << "Failed to open UDP port " << port << endl;
+            return false;
+        }
+        return host(&ownSocket, options);
+    }
+
+    // Sets up the match without opening a socket; the caller feeds packets to handle()
+    bool host(UdpSocket* shared, GameOptions options) {
+        socket = shared;
+        // Nobody watches the server's copy of the match
+        options.simulationOnly = true;
+        options.playerCount = max(1, min(255, options.playerCount));
+        game = new Game(options);
+        if (!game->running) return false;
+        clients.resize(game->players.size());
+        acks.assign(game->players.size(), 0);
+        for (int i = 0; i < game->players.size(); i++) {
+            clients[i].connected = false;
+            spawns.push_back({game->players.x[i], game->players.y[i]});
+            // Slots stay out of the match until someone joins
+            game->players.active[i] = 0;
+        }
+        game->syncObservation();
+        history.reset(*game);
+        return true;
+    }
+
+    int connectedCount() const {
+        int count = 0;
+        for (const auto& client : clients) count += client.connected;
+        return count;
+    }
+
+    bool hasClient(const sockaddr_in& address) const {
+        for (const auto& client : clients) {
+            if (client.connected && sameAddress(client.address, address)) return true;
+        }
+        return false;
+    }
+
+    void send(const sockaddr_in& to) {
+        if (socket->send(to, packet.data)) bytesSent += packet.data.size();
+    }
+
+    void join(const sockaddr_in& from) {
+        int slot = -1;
+        for (size_t i = 0; i < clients.size(); i++) {
+            if (clients[i].connected && sameAddress(clients[i].address, from)) slot = (int)i;
+        }
+        for (size_t i = 0; i < clients.size() && slot < 0; i++) {
+            if (!clients[i].connected) {
+                slot = (int)i;
+                clients[i].connected = true;
+                clients[i].address = from;
+                clients[i].lastSequence = 0;
+                clients[i].ackedTick = 0;
+                clients[i].pending.clear();
+                game->players.place((int)i, spawns[i].x, spawns[i].y);
+                game->players.active[i] = 1;
+            }
+        }
+        packet.clear();
+        if (slot < 0) {
+            packet.u8(NET_FULL);
+        } else {
+            clients[slot].lastHeard = tick;
+            packet.u8(NET_WELCOME);
+            packet.u8((Uint8)slot);
+            writeSetup(packet, game->options);
+            packet.u8((Uint8)tickRate);
+        }
+        send(from);
+    }
+
+    void leave(int slot) {
+        clients[slot].connected = false;
+        game->players.active[slot] = 0;
+    }
+
+    // One datagram; inputs are queued until the next tick
+    void handle(const sockaddr_in& from, const Uint8* data, int size) {
+        bytesReceived += size;
+        PacketReader in(data, size);
+        Uint8 type = in.u8();
+        if (type == NET_JOIN) {
+            if (in.u8() == NET_VERSION) join(from);
+            return;
+        }
+        int slot = in.u8();
+        if (!in.ok || slot >= (int)clients.size()) return;
+        Client& client = clients[slot];
+        if (!client.connected || !sameAddress(client.address, from)) return;
+        client.lastHeard = tick;
+        if (type == NET_LEAVE) {
+            leave(slot);
+        } else if (type == NET_INPUT) {
+            Uint32 sequence = in.u32();
+            Uint32 ackedTick = in.u32();
+            int count = in.u8();
+            if (!in.ok) return;
+            if (ackedTick > client.ackedTick && ackedTick <= tick) client.ackedTick = ackedTick;
+            if (sequence <= client.lastSequence) return;
+            // Each input comes again in later packets until acknowledged, so a lost packet loses no moves.
+            // Inputs are queued whole and oldest first; the acknowledgement stops before the
+            // first one left out, so the client keeps resending it.
+            Uint32 queuedUpTo = client.lastSequence;
+            for (int entry = 0; entry < count; entry++) {
+                Uint32 entrySequence = sequence - in.varint();
+                int length = in.u8();
+                if (!in.ok) break;
+                if (entrySequence <= client.lastSequence) {
+                    for (int i = 0; i < length; i++) in.u8();
+                    continue;
+                }
+                // A stalled client can't queue up more than a second of moves
+                if (!client.pending.empty() && client.pending.size() + length > 64) {
+                    client.lastSequence = entrySequence - 1;
+                    return;
+                }
+                size_t queued = client.pending.size();
+                for (int i = 0; i < length; i++) client.pending += (char)in.u8();
+                if (!in.ok) {
+                    client.pending.resize(queued);
+                    break;
+                }
+                queuedUpTo = entrySequence;
+            }
+            client.lastSequence = in.ok ? sequence : queuedUpTo;
+        }
+    }
+
+    // Drains the socket
+    void receive() {
+        sockaddr_in from;
+        int size;
+        while ((size = socket->receive(from, buffer.data(), (int)buffer.size())) > 0) {
+            handle(from, buffer.data(), size);
+        }
+    }
+
+    void step() {
+        for (size_t i = 0; i < clients.size(); i++) {
+            Client& client = clients[i];
+            if (!client.connected) continue;
+            if (tick - client.lastHeard > (Uint32)tickRate * 5) {
+                leave((int)i);
+                continue;
+            }
+            for (char action : client.pending) game->applyAction(action, (int)i);
+            client.pending.clear();
+            acks[i] = client.lastSequence;
+        }
+        if (game->running) game->update();
+        tick++;
+
+        Snapshot& current = history.slot(tick);
+        current.capture(*game, tick, acks);
+        for (const auto& client : clients) {
+            if (!client.connected) continue;
+            // Baselines that fell out of the history fall back to the match start
+            const Snapshot* base = history.find(client.ackedTick);
+            if (!base) base = &history.initial;
+            packet.clear();
+            writeDelta(packet, *base, current, scratch);
+            send(client.address);
+            snapshotsSent++;
+            snapshotBytes += packet.data.size();
+            fullSnapshotBytes += fullSnapshotSize(current);
+        }
+    }
+
+    void report() const {
+        if (!snapshotsSent) return;
+        cout << "Sent " << snapshotsSent << " snapshots over " << tick << " ticks: "
+             << (double)snapshotBytes / snapshotsSent << " bytes/tick per client (full state would be "
+             << (double)fullSnapshotBytes / snapshotsSent << ")" << endl;
+    }
+
+    // Fixed-rate ticks, sleeping on the socket in between so inputs are picked
+    // up as they arrive. Returns a few seconds after the match ends, or when stop is set.
+    void run(const atomic<bool>* stop) {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        Uint64 period = (Uint64)(freq / tickRate);
+        Uint64 next = SDL_GetPerformanceCounter() + period;
+        int endTicks = 0;
+        while (!(stop && *stop) && endTicks < tickRate * 3) {
+            receive();
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (now < next) {
+                socket->wait((int)((next - now) * 1e6 / freq) + 1);
+                continue;
+            }
+            step();
+            next += period;
+            // Don't try to catch up after a long stall
+            if (now > next + period * 4) next = now + period;
+            if (!game->running) endTicks++;
+        }
+    }
+
+    ~NetServer() {
+        delete game;
+    }
+};
+
+#ifndef BATTLECITY_SERVER
+// Sends local input every frame and draws the match from the server's snapshots.
+// The client's Game never simulates: it is built from the server's setup so the
+// wall layout matches, then overwritten before each frame is drawn.
+//
+// The local tank is predicted: its moves show at once, and each snapshot
+// resets it to the server's position and replays the moves the server hadn't
+// applied yet. Everything else is drawn interpolationDelayMs in the past,
+// between the two snapshots around that moment, so it moves smoothly however
+// the packets arrive.
+class NetClient {
+public:
+    struct SentInput {
+        Uint32 sequence;
+        string actions;
+    };
+
+    UdpSocket socket;
+    sockaddr_in server;
+    Game* game;
+    int slot;
+    Uint32 sequence;
+    Uint32 serverTick;
+    Uint32 lastSnapshot;
+    string actions;
+    vector<Uint32> acks;
+    SnapshotHistory history;
+    vector<Uint32> scratch;
+    PacketWriter packet;
+    vector<Uint8> buffer;
+    size_t bytesReceived;
+    int tickRate;
+    bool predict;
+    int interpolationDelayMs;
+    // Inputs sent that the newest snapshot hasn't applied yet; resent with every packet
+    vector<SentInput> unacked;
+    PlayerState predicted;
+    size_t corrections;
+    // Local milliseconds at server tick 0, from the snapshots that arrived soonest
+    double clockOffsetMs;
+    bool clockKnown;
+    Snapshot view;
+
+    NetClient() {
+        game = NULL;
+        slot = -1;
+        sequence = 0;
+        serverTick = 0;
+        lastSnapshot = 0;
+        bytesReceived = 0;
+        tickRate = 60;
+        predict = true;
+        interpolationDelayMs = 100;
+        predicted = {0, 0, 0, 0, 0, 0};
+        corrections = 0;
+        clockOffsetMs = 0;
+        clockKnown = false;
+        buffer.resize(65536);
+    }
+
+    // Asks for a slot until the server answers or five seconds pass
+    bool connect(const sockaddr_in& address, GameOptions options) {
+        server = address;
+        if (!socket.open(0)) {
+            cerr << "Failed to open UDP socket" << endl;
+            return false;
+        }
+        Uint32 start = SDL_GetTicks();
+        while (SDL_GetTicks() - start < 5000) {
+            packet.clear();
+            packet.u8(NET_JOIN);
+            packet.u8(NET_VERSION);
+            socket.send(server, packet.data);
+            socket.wait(250000);
+            sockaddr_in from;
+            int size;
+            while ((size = socket.receive(from, buffer.data(), (int)buffer.size())) > 0) {
+                if (!sameAddress(from, server)) continue;
+                PacketReader in(buffer.data(), size);
+                Uint8 type = in.u8();
+                if (type == NET_FULL) {
+                    cerr << "Server is full" << endl;
+                    return false;
+                }
+                if (type != NET_WELCOME) continue;
+                int assigned = in.u8();
+                readSetup(in, options);
+                int rate = in.u8();
+                if (!in.ok || assigned >= options.playerCount || rate == 0) continue;
+                slot = assigned;
+                tickRate = rate;
+                game = new Game(options);
+                history.reset(*game);
+                lastSnapshot = SDL_GetTicks();
+                return game->running;
+            }
+        }
+        cerr << "No answer from server" << endl;
+        return false;
+    }
+
+    void queueAction(char action) {
+        actions += action;
+    }
+
+    // Moves the predicted tank against the newest known walls; shots are left to the server
+    void predictMoves(const string& moves) {
+        TankStore& tanks = game->players;
+        if (!predicted.active) return;
+        tanks.place(slot, predicted.x, predicted.y);
+        for (char action : moves) {
+            int dx, dy;
+            if (Game::actionStep(action, dx, dy)) tanks.move(slot, dx, dy, game->walls, game->map);
+        }
+        predicted.x = tanks.x[slot];
+        predicted.y = tanks.y[slot];
+        predicted.dirX = tanks.dirX[slot];
+        predicted.dirY = tanks.dirY[slot];
+    }
+
+    // Sent every frame, empty or not, so the server knows the client is alive
+    void sendInput() {
+        sequence++;
+        if (!actions.empty()) {
+            SentInput sent = {sequence, actions.substr(0, min((int)actions.size(), 255))};
+            if (predict) predictMoves(sent.actions);
+            unacked.push_back(sent);
+            // A server that stopped acknowledging is gone anyway; don't let packets grow without bound
+            if (unacked.size() > 32) unacked.erase(unacked.begin());
+        }
+        actions.clear();
+        packet.clear();
+        packet.u8(NET_INPUT);
+        packet.u8((Uint8)slot);
+        packet.u32(sequence);
+        packet.u32(serverTick);
+        packet.u8((Uint8)unacked.size());
+        for (const auto& sent : unacked) {
+            packet.varint(sequence - sent.sequence);
+            packet.u8((Uint8)sent.actions.size());
+            for (char action : sent.actions) packet.u8((Uint8)action);
+        }
+        socket.send(server, packet.data);
+    }
+
+    // Server position plus the moves it hasn't applied yet
+    void reconcile(const Snapshot& latest) {
+        const PlayerState& authoritative = latest.players[slot];
+        size_t applied = 0;
+        while (applied < unacked.size() && unacked[applied].sequence <= authoritative.ack) applied++;
+        unacked.erase(unacked.begin(), unacked.begin() + applied);
+        if (!predict) return;
+        PlayerState before = predicted;
+        predicted = authoritative;
+        for (int w = 0; w < (int)latest.walls.size() && w < game->walls.size(); w++) {
+            game->walls.active[w] = latest.walls[w] != 0;
+        }
+        for (const auto& sent : unacked) predictMoves(sent.actions);
+        if (before.active && (before.x != predicted.x || before.y != predicted.y)) corrections++;
+    }
+
+    // Reads every snapshot waiting on the socket; true if there was a new one
+    bool receive() {
+        bool updated = false;
+        sockaddr_in from;
+        int size;
+        while ((size = socket.receive(from, buffer.data(), (int)buffer.size())) > 0) {
+            if (!sameAddress(from, server)) continue;
+            PacketReader in(buffer.data(), size);
+            if (in.u8() != NET_SNAPSHOT) continue;
+            Uint32 tick = in.varint();
+            Uint32 baseTick = in.varint();
+            const Snapshot* base = history.find(baseTick);
+            if (!in.ok || !base || tick <= baseTick || tick <= serverTick) continue;
+            Snapshot& current = history.slot(tick);
+            if (&current == base) continue;
+            if (!readDelta(in, *base, tick, current, scratch)) {
+                current.tick = 0;
+                continue;
+            }
+            bytesReceived += size;
+            serverTick = tick;
+            updated = true;
+            // Late packets only ever make the offset look bigger, so drop to any
+            // smaller sample at once and drift up slowly in case the route got slower
+            double sample = SDL_GetTicks() - tick * 1000.0 / tickRate;
+            if (!clockKnown || sample < clockOffsetMs) {
+                clockOffsetMs = sample;
+                clockKnown = true;
+            } else {
+                clockOffsetMs += (sample - clockOffsetMs) * 0.01;
+            }
+        }
+        if (updated) {
+            const Snapshot& latest = *history.find(serverTick);
+            acks.resize(latest.players.size());
+            for (size_t i = 0; i < acks.size(); i++) acks[i] = latest.players[i].ack;
+            reconcile(latest);
+            lastSnapshot = SDL_GetTicks();
+        }
+        return updated;
+    }
+
+    // The match as of interpolationDelayMs ago: the newer snapshot's set of
+    // tanks and bullets, each placed between its two known positions
+    void sample(Uint32 nowMs) {
+        const Snapshot* latest = history.find(serverTick);
+        if (!latest) return;
+        double at = (nowMs - clockOffsetMs - interpolationDelayMs) * tickRate / 1000.0;
+        const Snapshot* before = NULL;
+        const Snapshot* after = NULL;
+        for (const auto& snapshot : history.ring) {
+            if (snapshot.tick == 0) continue;
+            if (snapshot.tick <= at && (!before || snapshot.tick > before->tick)) before = &snapshot;
+            if (snapshot.tick > at && (!after || snapshot.tick < after->tick)) after = &snapshot;
+        }
+        if (interpolationDelayMs <= 0 || !after) {
+            // Nothing newer to move towards; hold the newest state rather than guess
+            view = *latest;
+        } else if (!before) {
+            view = *after;
+        } else {
+            double t = (at - before->tick) / (after->tick - before->tick);
+            view = *after;
+            for (size_t i = 0; i < view.players.size() && i < before->players.size(); i++) {
+                PlayerState& player = view.players[i];
+                const PlayerState& from = before->players[i];
+                if (!player.active || !from.active) continue;
+                player.x = from.x + (int)lround((player.x - from.x) * t);
+                player.y = from.y + (int)lround((player.y - from.y) * t);
+            }
+            size_t e = 0;
+            for (auto& enemy : view.enemies) {
+                while (e < before->enemies.size() && before->enemies[e].id < enemy.id) e++;
+                if (e == before->enemies.size() || before->enemies[e].id != enemy.id) continue;
+                enemy.x = before->enemies[e].x + (int)lround((enemy.x - before->enemies[e].x) * t);
+                enemy.y = before->enemies[e].y + (int)lround((enemy.y - before->enemies[e].y) * t);
+            }
+            size_t b = 0;
+            for (auto& bullet : view.bullets) {
+                while (b < before->bullets.size() && before->bullets[b].id < bullet.id) b++;
+                if (b == before->bullets.size() || before->bullets[b].id != bullet.id) continue;
+                bullet.x = before->bullets[b].x + (int)lround((bullet.x - before->bullets[b].x) * t);
+                bullet.y = before->bullets[b].y + (int)lround((bullet.y - before->bullets[b].y) * t);
+            }
+            // Walls and the match result are the newest the server sent
+            view.walls = latest->walls;
+            view.flags = latest->flags;
+        }
+        view.apply(*game);
+        if (predict && predicted.active && slot < game->players.size()) {
+            TankStore& tanks = game->players;
+            tanks.place(slot, predicted.x, predicted.y);
+            tanks.dirX[slot] = predicted.dirX;
+            tanks.dirY[slot] = predicted.dirY;
+        }
+    }
+
+    bool timedOut() const {
+        return SDL_GetTicks() - lastSnapshot > 5000;
+    }
+
+    void run() {
+        while (game->running) {
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                if (event.type == SDL_QUIT) {
+                    game->running = false;
+                } else if (event.type == SDL_KEYDOWN) {
+                    char action = Game::actionForKey(event.key.keysym.sym);
+                    if (action) queueAction(action);
+                }
+            }
+            sendInput();
+            receive();
+            if (timedOut()) {
+                cerr << "Lost connection to server" << endl;
+                break;
+            }
+            sample(SDL_GetTicks());
+            game->render();
+            game->arena.reset();
+            SDL_Delay(16);
+        }
+        game->showEndScreen();
+        if (predict) cout << "Prediction: " << corrections << " corrections" << endl;
+    }
+
+    void leave() {
+        if (slot < 0) return;
+        packet.clear();
+        packet.u8(NET_LEAVE);
+        packet.u8((Uint8)slot);
+        socket.send(server, packet.data);
+        slot = -1;
+    }
+
+    ~NetClient() {
+        leave();
+        delete game;
+    }
+};
+
+// Sits between clients and a server and makes the loopback behave like a real
+// link: each datagram is held for latency plus uniform jitter, in both
+// directions, and a fraction are dropped. Jitter can reorder packets, as on the
+// internet. Each client gets its own upstream socket so the server still sees
+// one address per client.
+class UdpProxy {
+public:
+    struct Route {
+        sockaddr_in client;
+        UdpSocket* upstream;
+    };
+
+    struct Delayed {
+        Uint32 due;
+        int route;
+        bool toServer;
+        vector<Uint8> data;
+    };
+
+    UdpSocket listener;
+    sockaddr_in target;
+    vector<Route> routes;
+    // Min-heap on due time
+    vector<Delayed> queue;
+    int latencyMs;
+    int jitterMs;
+    double loss;
+    Uint32 rng;
+    vector<Uint8> buffer;
+    size_t forwarded;
+    size_t dropped;
+
+    UdpProxy() {
+        latencyMs = 0;
+        jitterMs = 0;
+        loss = 0;
+        rng = 12345;
+        forwarded = 0;
+        dropped = 0;
+        buffer.resize(65536);
+    }
+
+    bool start(Uint16 port, const sockaddr_in& server) {
+        target = server;
+        if (!listener.open(port)) {
+            cerr << "Failed to open UDP port " << port << " for the proxy" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool later(const Delayed& a, const Delayed& b) {
+        return a.due > b.due;
+    }
+
+    void delay(int route, bool toServer, const Uint8* data, int size) {
+        if (loss > 0 && (nextRandom(rng) % 10000) < loss * 10000) {
+            dropped++;
+            return;
+        }
+        int jitter = jitterMs > 0 ? (int)(nextRandom(rng) % (2 * jitterMs + 1)) - jitterMs : 0;
+        Delayed packet = {SDL_GetTicks() + (Uint32)max(0, latencyMs + jitter), route, toServer,
+                          vector<Uint8>(data, data + size)};
+        queue.push_back(packet);
+        push_heap(queue.begin(), queue.end(), later);
+    }
+
+    int routeFor(const sockaddr_in& client) {
+        for (size_t r = 0; r < routes.size(); r++) {
+            if (sameAddress(routes[r].client, client)) return (int)r;
+        }
+        UdpSocket* upstream = new UdpSocket();
+        if (!upstream->open(0)) {
+            delete upstream;
+            return -1;
+        }
+        routes.push_back({client, upstream});
+        return (int)routes.size() - 1;
+    }
+
+    void pump() {
+        sockaddr_in from;
+        int size;
+        while ((size = listener.receive(from, buffer.data(), (int)buffer.size())) > 0) {
+            int route = routeFor(from);
+            if (route >= 0) delay(route, true, buffer.data(), size);
+        }
+        for (size_t r = 0; r < routes.size(); r++) {
+            while ((size = routes[r].upstream->receive(from, buffer.data(), (int)buffer.size())) > 0) {
+                if (sameAddress(from, target)) delay((int)r, false, buffer.data(), size);
+            }
+        }
+        Uint32 now = SDL_GetTicks();
+        while (!queue.empty() && (Sint32)(now - queue.front().due) >= 0) {
+            pop_heap(queue.begin(), queue.end(), later);
+            const Delayed& packet = queue.back();
+            Route& route = routes[packet.route];
+            if (packet.toServer) {
+                route.upstream->send(target, packet.data);
+            } else {
+                listener.send(route.client, packet.data);
+            }
+            forwarded++;
+            queue.pop_back();
+        }
+    }
+
+    void run(const atomic<bool>* stop) {
+        while (!(stop && *stop)) {
+            pump();
+            // Upstream sockets aren't watched, so don't sleep long
+            listener.wait(1000);
+        }
+    }
+
+    ~UdpProxy() {
+        for (auto& route : routes) delete route.upstream;
+    }
+};
+
+// Peers that each run the whole simulation and exchange only inputs.
+//
+// Rollback (GGPO style): local input is applied at once; input not yet heard
+// from a peer is guessed to be idle, since actions are key presses rather than
+// held state. When a peer's input for a past tick turns out different from the
+// guess, the game goes back to the state saved before that tick and replays to
+// the present in the same frame. Nobody runs more than predictionWindow ticks
+// ahead of what it has heard.
+//
+// Lockstep is the same with a window of 0: a tick only runs once every peer's
+// input for it is in, and local input is scheduled inputDelay ticks ahead so
+// the round trip is hidden.
+//
+// Every hashInterval ticks, each tick simulated with complete input is hashed
+// per subsystem and the hash sent along with the inputs; a peer with a
+// different hash for the same tick has desynced, and the parts that differ are
+// reported.
+class PeerSession {
+public:
+    static const int ROLLBACK_WINDOW = 8;
+    static const int RING = 64;
+    // Hashes carried by each input packet, newest first
+    static const int HASHES_PER_PACKET = 4;
+
+    struct HashRecord {
+        Uint32 tick;
+        bool computed;
+        StateHash local;
+        // Per slot: the peer's hash for this tick, which may arrive before ours
+        vector<StateHash> remote;
+        vector<Uint8> heard;
+    };
+
+    Game* game;
+    int localSlot;
+    int predictionWindow;
+    int inputDelay;
+    int hashInterval;
+    UdpSocket socket;
+    // Indexed by slot; the local entry is unused
+    vector<sockaddr_in> peers;
+    Uint32 tick;
+    // Next tick without local input; runs inputDelay ahead of tick
+    Uint32 localUntil;
+    // Per ring row: the tick it holds, then each slot's actions and whether they are real
+    vector<Uint32> rowTick;
+    vector<vector<string>> inputs;
+    vector<vector<Uint8>> confirmed;
+    // State before each tick in the ring
+    vector<GameState> states;
+    // Per slot: every tick below this has confirmed input
+    vector<Uint32> heardUntil;
+    // Per slot: ticks below this the peer has confirmed hearing from us
+    vector<Uint32> peerAcked;
+    vector<HashRecord> hashes;
+    // Ticks of our newest hashes, sent with every input packet
+    vector<Uint32> recentHashes;
+    bool desynced;
+    PacketWriter packet;
+    vector<Uint8> buffer;
+    size_t rollbacks;
+    size_t resimulatedTicks;
+    int deepestRollback;
+    size_t stalls;
+    Uint32 lastHeard;
+    Uint64 simulateCounter;
+    Uint64 hashCounter;
+
+    PeerSession() : rowTick(RING, UINT_MAX), inputs(RING), confirmed(RING), states(RING), hashes(RING) {
+        game = NULL;
+        localSlot = 0;
+        predictionWindow = ROLLBACK_WINDOW;
+        inputDelay = 0;
+        hashInterval = 8;
+        tick = 0;
+        localUntil = 0;
+        desynced = false;
+        rollbacks = 0;
+        resimulatedTicks = 0;
+        deepestRollback = 0;
+        stalls = 0;
+        lastHeard = 0;
+        simulateCounter = 0;
+        hashCounter = 0;
+        buffer.resize(65536);
+    }
+
+    // Every peer must pass the same options and mode apart from the slot
+    bool start(const GameOptions& options, int slot, Uint16 port, const vector<sockaddr_in>& others) {
+        GameOptions sessionOptions = options;
+        sessionOptions.playerCount = (int)others.size() + 1;
+        // Time-based AI throttling would differ between machines
+        sessionOptions.aiBudgetUs = 0;
+        if (slot < 0 || slot >= sessionOptions.playerCount) return false;
+        if (!socket.open(port)) {
+            cerr << "Failed to open UDP port " << port << endl;
+            return false;
+        }
+        localSlot = slot;
+        peers.resize(sessionOptions.playerCount);
+        for (int s = 0, next = 0; s < sessionOptions.playerCount; s++) {
+            if (s != slot) peers[s] = others[next++];
+        }
+        heardUntil.assign(sessionOptions.playerCount, 0);
+        peerAcked.assign(sessionOptions.playerCount, 0);
+        for (int r = 0; r < RING; r++) {
+            inputs[r].resize(sessionOptions.playerCount);
+            confirmed[r].resize(sessionOptions.playerCount);
+            hashes[r].tick = UINT_MAX;
+            hashes[r].remote.resize(sessionOptions.playerCount);
+            hashes[r].heard.resize(sessionOptions.playerCount);
+        }
+        // The first inputDelay ticks run without local input
+        inputDelay = max(0, min(inputDelay, RING / 4));
+        for (localUntil = 0; localUntil < (Uint32)inputDelay; localUntil++) {
+            confirmed[row(localUntil)][localSlot] = 1;
+        }
+        game = new Game(sessionOptions);
+        lastHeard = SDL_GetTicks();
+        return game->running;
+    }
+
+    int playerCount() const {
+        return (int)peers.size();
+    }
+
+    // Makes the ring row for t current, forgetting whatever tick it held before
+    int row(Uint32 t) {
+        int r = t % RING;
+        if (rowTick[r] != t) {
+            rowTick[r] = t;
+            for (int s = 0; s < playerCount(); s++) {
+                inputs[r][s].clear();
+                confirmed[r][s] = 0;
+            }
+        }
+        return r;
+    }
+
+    HashRecord& hashRecord(Uint32 t) {
+        HashRecord& record = hashes[t % RING];
+        if (record.tick != t) {
+            record.tick = t;
+            record.computed = false;
+            for (auto& heard : record.heard) heard = 0;
+        }
+        return record;
+    }
+
+    Uint32 slowestPeer() const {
+        Uint32 slowest = UINT_MAX;
+        for (int s = 0; s < playerCount(); s++) {
+            if (s != localSlot) slowest = min(slowest, heardUntil[s]);
+        }
+        return slowest;
+    }
+
+    void simulate(Uint32 t) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        int r = row(t);
+        game->saveState(states[r]);
+        for (int s = 0; s < playerCount(); s++) {
+            for (char action : inputs[r][s]) game->applyAction(action, s);
+        }
+        game->update();
+        simulateCounter += SDL_GetPerformanceCounter() - start;
+        hashTick(t);
+    }
+
+    // Hashes the live game as the state after tick t, once that state is final:
+    // built from nothing but confirmed input
+    void hashTick(Uint32 t) {
+        if (t % hashInterval != 0 || t >= slowestPeer() || t >= localUntil) return;
+        HashRecord& record = hashRecord(t);
+        if (record.computed) return;
+        Uint64 start = SDL_GetPerformanceCounter();
+        record.computed = true;
+        game->hashState(record.local);
+        recentHashes.insert(recentHashes.begin(), t);
+        if ((int)recentHashes.size() > HASHES_PER_PACKET) recentHashes.pop_back();
+        for (int s = 0; s < playerCount(); s++) {
+            if (record.heard[s]) checkHash(s, record);
+        }
+        hashCounter += SDL_GetPerformanceCounter() - start;
+    }
+
+    void checkHash(int slot, const HashRecord& record) {
+        if (desynced) return;
+        string parts;
+        for (int p = 0; p < HASH_PARTS; p++) {
+            if (record.local.part[p] != record.remote[slot].part[p]) {
+                parts += string(parts.empty() ? "" : ", ") + HASH_PART_NAMES[p];
+            }
+        }
+        if (parts.empty()) return;
+        desynced = true;
+        cerr << "Desync with peer " << slot << " at tick " << record.tick << ": " << parts << " differ" << endl;
+    }
+
+    // Reads peer inputs and hashes; returns the earliest simulated tick whose guess was wrong
+    Uint32 receive() {
+        Uint32 rollbackTo = UINT_MAX;
+        sockaddr_in from;
+        int size;
+        while ((size = socket.receive(from, buffer.data(), (int)buffer.size())) > 0) {
+            PacketReader in(buffer.data(), size);
+            if (in.u8() != NET_PEER_INPUT) continue;
+            int slot = in.u8();
+            if (!in.ok || slot >= playerCount() || slot == localSlot || !sameAddress(from, peers[slot])) continue;
+            Uint32 acked = in.varint();
+            Uint32 first = in.varint();
+            Uint32 count = in.varint();
+            if (!in.ok) continue;
+            lastHeard = SDL_GetTicks();
+            peerAcked[slot] = max(peerAcked[slot], acked);
+            string actions;
+            for (Uint32 i = 0; i < count && in.ok; i++) {
+                Uint32 t = first + i;
+                actions.clear();
+                int length = in.u8();
+                for (int a = 0; a < length && in.ok; a++) actions += (char)in.u8();
+                // Too old to matter, or further ahead than anyone may run
+                if (!in.ok || t < heardUntil[slot] || t >= tick + RING / 2) continue;
+                int r = row(t);
+                if (confirmed[r][slot]) continue;
+                if (t < tick && inputs[r][slot] != actions) rollbackTo = min(rollbackTo, t);
+                inputs[r][slot] = actions;
+                confirmed[r][slot] = 1;
+            }
+            while (heardUntil[slot] < tick + RING / 2 && rowTick[heardUntil[slot] % RING] == heardUntil[slot] &&
+                   confirmed[heardUntil[slot] % RING][slot]) {
+                heardUntil[slot]++;
+            }
+            int hashCount = in.u8();
+            for (int h = 0; h < hashCount && in.ok; h++) {
+                Uint32 t = in.varint();
+                StateHash remote;
+                for (int p = 0; p < HASH_PARTS; p++) {
+                    Uint64 low = in.u32();
+                    remote.part[p] = low | (Uint64)in.u32() << 32;
+                }
+                // Hashes outside the ring can no longer be matched with ours
+                if (!in.ok || t + RING / 2 < tick || t >= tick + RING / 2) continue;
+                HashRecord& record = hashRecord(t);
+                record.remote[slot] = remote;
+                record.heard[slot] = 1;
+                if (record.computed) checkHash(slot, record);
+            }
+        }
+        return rollbackTo;
+    }
+
+    void rollback(Uint32 to) {
+        game->loadState(states[to % RING]);
+        game->resimulating = true;
+        for (Uint32 t = to; t < tick; t++) simulate(t);
+        game->resimulating = false;
+        rollbacks++;
+        resimulatedTicks += tick - to;
+        deepestRollback = max(deepestRollback, (int)(tick - to));
+    }
+
+    // Our inputs each peer hasn't acknowledged yet, resent every frame, and our newest hashes
+    void send() {
+        for (int s = 0; s < playerCount(); s++) {
+            if (s == localSlot) continue;
+            Uint32 first = max(peerAcked[s], localUntil > (Uint32)RING / 2 ? localUntil - RING / 2 : 0);
+            packet.clear();
+            packet.u8(NET_PEER_INPUT);
+            packet.u8((Uint8)localSlot);
+            packet.varint(heardUntil[s]);
+            packet.varint(first);
+            packet.varint(localUntil - first);
+            for (Uint32 t = first; t < localUntil; t++) {
+                const string& actions = inputs[t % RING][localSlot];
+                int length = min((int)actions.size(), 255);
+                packet.u8((Uint8)length);
+                for (int a = 0; a < length; a++) packet.u8((Uint8)actions[a]);
+            }
+            packet.u8((Uint8)recentHashes.size());
+            for (Uint32 t : recentHashes) {
+                const StateHash& hash = hashes[t % RING].local;
+                packet.varint(t);
+                for (int p = 0; p < HASH_PARTS; p++) {
+                    packet.u32((Uint32)hash.part[p]);
+                    packet.u32((Uint32)(hash.part[p] >> 32));
+                }
+            }
+            socket.send(peers[s], packet.data);
+        }
+    }
+
+    // One frame: fix up the past, then step once with the local actions unless
+    // that would run too far ahead of a peer or the match is over. Returns false
+    // when no tick ran.
+    bool advance(const string& localActions) {
+        Uint32 rollbackTo = receive();
+        if (rollbackTo < tick) rollback(rollbackTo);
+        // A guess that turned out right needs no resimulation, so the present
+        // is hashed here once it is confirmed
+        if (tick > 0) hashTick(tick - 1);
+        bool stepped = false;
+        if (!game->running) {
+            // Waiting for the peers to confirm the ticks that ended the match
+        } else if (tick < slowestPeer() + predictionWindow) {
+            int r = row(localUntil);
+            inputs[r][localSlot] = localActions;
+            confirmed[r][localSlot] = 1;
+            localUntil++;
+            simulate(tick);
+            tick++;
+            stepped = true;
+        } else {
+            stalls++;
+        }
+        send();
+        return stepped;
+    }
+
+    // A match only ends once every peer's input up to the final tick is in,
+    // since a late input could still undo the ending
+    bool finished() const {
+        return !game->running && slowestPeer() >= tick;
+    }
+
+    void run() {
+        string actions;
+        bool quit = false;
+        while (!quit && !finished() && !desynced) {
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                if (event.type == SDL_QUIT) {
+                    quit = true;
+                } else if (event.type == SDL_KEYDOWN) {
+                    char action = Game::actionForKey(event.key.keysym.sym);
+                    if (action) actions += action;
+                }
+            }
+            // Keys pressed during a stall wait for the next tick that runs
+            if (advance(actions)) actions.clear();
+            if (SDL_GetTicks() - lastHeard > 5000) {
+                cerr << "Lost contact with peers" << endl;
+                break;
+            }
+            game->render();
+            SDL_Delay(16);
+        }
+        // Peers may still be waiting on our last inputs
+        for (int i = 0; i < 10; i++) {
+            send();
+            SDL_Delay(16);
+        }
+        if (finished()) game->showEndScreen();
+        report();
+    }
+
+    void report() const {
+        cout << (predictionWindow ? "Rollback: " : "Lockstep: ") << tick << " ticks, " << rollbacks << " rollbacks, "
+             << resimulatedTicks << " ticks resimulated, deepest " << deepestRollback << ", " << stalls
+             << " stalled frames, hashing " << (simulateCounter ? 100.0 * hashCounter / simulateCounter : 0)
+             << "% of tick time" << (desynced ? ", DESYNCED" : "") << endl;
+    }
+
+    ~PeerSession() {
+        delete game;
+    }
+};
 
-        if (enemies.empty()) {
-            isVictory = true;
-            running = false;
-            endTime = SDL_GetTicks();
+void printStress(const GameOptions& options, const StressResult& result) {
+    cout << "Stress " << options.mapWidth << "x" << options.mapHeight << " map, "
+         << options.enemyCount << " enemies, walls " << options.wallDensity()
+         << ", fire cooldown " << options.enemyFireCooldown << ": "
+         << result.ticksPerSecond << " ticks/s, " << result.averageMs << " ms avg, "
+         << result.maxMs << " ms max, peak memory " << result.peakMemory / (1024 * 1024) << " MB" << endl;
+}
+
+// Doubles the enemy count and the map area until the average tick misses the budget
+void runStressScaling(GameOptions options, int ticks, double budgetMs) {
+    GameOptions lastPassing = options;
+    bool passed = false;
+    while (true) {
+        StressResult result;
+        {
+            Game game(options);
+            if (!game.running) return;
+            result = game.runStress(ticks);
         }
+        printStress(options, result);
+        if (result.averageMs > budgetMs) break;
+        lastPassing = options;
+        passed = true;
+        options.enemyCount *= 2;
+        options.mapWidth = (int)(options.mapWidth * 1.41421356);
+        options.mapHeight = (int)(options.mapHeight * 1.41421356);
     }
+    if (passed) {
+        cout << "Capacity within " << budgetMs << " ms: " << lastPassing.enemyCount << " enemies on a "
+             << lastPassing.mapWidth << "x" << lastPassing.mapHeight << " map" << endl;
+    } else {
+        cout << "Starting scenario already exceeds " << budgetMs << " ms" << endl;
+    }
+}
+#endif
 
-    void render() {
-        SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
-        SDL_RenderClear(renderer);
+// Compares incremental repair against a full rebuild on a large random map
+// with walls toggling every step; both fields must agree at the end.
+void benchmarkPathing(int width, int height, int flips) {
+    srand(1);
+    FlowField repaired(width, height), rebuilt(width, height);
+    for (int cell = 0; cell < width * height; cell++) {
+        int row = cell / width, col = cell % width;
+        bool border = row == 0 || col == 0 || row == height - 1 || col == width - 1;
+        Uint8 wall = border || rand() % 100 < 30;
+        repaired.blocked[cell] = wall;
+        rebuilt.blocked[cell] = wall;
+    }
+    int target = (height / 2) * width + width / 2;
+    repaired.blocked[target] = 0;
+    rebuilt.blocked[target] = 0;
+    repaired.setTarget(target);
+    rebuilt.setTarget(target);
 
-        if (isVictory || isGameOver) {
-            SDL_Texture* endTexture = isVictory ? winTexture : gameOverTexture;
-            if (endTexture) {
-                SDL_RenderCopy(renderer, endTexture, NULL, NULL);
+    vector<int> cells(flips);
+    for (auto& cell : cells) {
+        do {
+            cell = (rand() % (height - 2) + 1) * width + rand() % (width - 2) + 1;
+        } while (cell == target);
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int cell : cells) {
+        if (repaired.blocked[cell]) repaired.openCell(cell);
+        else repaired.closeCell(cell);
+    }
+    Uint64 repairTime = SDL_GetPerformanceCounter() - start;
+
+    start = SDL_GetPerformanceCounter();
+    for (int cell : cells) {
+        rebuilt.blocked[cell] = !rebuilt.blocked[cell];
+        rebuilt.recompute();
+    }
+    Uint64 rebuildTime = SDL_GetPerformanceCounter() - start;
+
+    double freq = (double)SDL_GetPerformanceFrequency();
+    double repairUs = repairTime * 1e6 / freq / flips;
+    double rebuildUs = rebuildTime * 1e6 / freq / flips;
+    bool match = repaired.distance == rebuilt.distance;
+    cout << "Pathing " << width << "x" << height << ", " << flips << " wall flips: repair "
+         << repairUs << " us/flip, full recompute " << rebuildUs << " us/flip ("
+         << (repairUs > 0 ? rebuildUs / repairUs : 0) << "x), fields "
+         << (match ? "match" : "DIFFER") << endl;
+}
+
+#ifdef BATTLECITY_BENCH
+// Hardware cache misses of the calling thread through Linux perf events.
+// Elsewhere, or when the kernel refuses, available() is false.
+class CacheMissCounter {
+public:
+    int fd;
+
+    CacheMissCounter() {
+        fd = -1;
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~CacheMissCounter() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    bool available() const {
+        return fd >= 0;
+    }
+
+    void start() {
+#ifdef __linux__
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    long long stop() {
+        long long count = 0;
+#ifdef __linux__
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) count = 0;
+#endif
+        return count;
+    }
+};
+
+struct BenchResult {
+    string name;
+    int count;
+    long long ops;
+    double nsPerOp;
+    // Negative when the build can't measure it
+    double allocationsPerOp;
+    double cacheMissesPerOp;
+};
+
+class MicroBench {
+public:
+    double minSeconds;
+    string filter;
+    vector<BenchResult> results;
+    CacheMissCounter cacheMisses;
+
+    MicroBench() {
+        minSeconds = 0.2;
+    }
+
+    bool selected(const string& name) const {
+        return filter.empty() || name.find(filter) != string::npos;
+    }
+
+    // Calls body, which performs opsPerCall operations, until minSeconds have passed.
+    // One untimed call first so buffers are grown and caches warm.
+    void run(const string& name, int count, long long opsPerCall, const function<void()>& body) {
+        body();
+        double freq = (double)SDL_GetPerformanceFrequency();
+        long long calls = 0;
+#ifdef COUNT_ALLOCATIONS
+        size_t heapBefore = heapAllocations;
+#endif
+        cacheMisses.start();
+        Uint64 start = SDL_GetPerformanceCounter();
+        double elapsed = 0;
+        while (elapsed < minSeconds) {
+            body();
+            calls++;
+            elapsed = (SDL_GetPerformanceCounter() - start) / freq;
+        }
+        long long misses = cacheMisses.stop();
+
+        BenchResult result;
+        result.name = name;
+        result.count = count;
+        result.ops = calls * opsPerCall;
+        result.nsPerOp = elapsed * 1e9 / result.ops;
+#ifdef COUNT_ALLOCATIONS
+        result.allocationsPerOp = (double)(heapAllocations - heapBefore) / result.ops;
+#else
+        result.allocationsPerOp = -1;
+#endif
+        result.cacheMissesPerOp = cacheMisses.available() ? (double)misses / result.ops : -1;
+        results.push_back(result);
+        cerr << name << " [" << count << "]: " << result.nsPerOp << " ns/op" << endl;
+    }
+
+    void writeJson(ostream& out) const {
+        out << "{\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& r = results[i];
+            out << "    {\"name\": \"" << r.name << "\", \"count\": " << r.count
+                << ", \"ops\": " << r.ops << ", \"ns_per_op\": " << r.nsPerOp << ", \"allocations_per_op\": ";
+            if (r.allocationsPerOp < 0) out << "null";
+            else out << r.allocationsPerOp;
+            out << ", \"cache_misses_per_op\": ";
+            if (r.cacheMissesPerOp < 0) out << "null";
+            else out << r.cacheMissesPerOp;
+            out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+};
+
+// Square map with room for roughly tilesPerEntity free tiles per entity
+GameOptions benchOptions(int count, int tilesPerEntity) {
+    GameOptions options;
+    options.headless = true;
+    options.aiThreads = 1;
+    options.endless = true;
+    options.wallThreshold = 1500;
+    int side = max(MAP_WIDTH, (int)sqrt((double)count * tilesPerEntity) + 4);
+    options.mapWidth = side;
+    options.mapHeight = side;
+    options.enemyCount = count;
+    return options;
+}
+
+// Fills the store with bullets sitting in tiles no wall, enemy or player touches,
+// so a collision pass scans everything without changing the game.
+void spawnHarmlessBullets(Game& game, int count) {
+    MapSize& map = game.map;
+    vector<Uint8> taken(map.tiles(), 0);
+    for (const auto& wall : game.walls.rect) taken[map.tileIndex(wall.x, wall.y, TILE_SIZE)] = 1;
+    for (const auto& enemy : game.enemies.rect) {
+        // Enemies may sit across a tile boundary, block all four tiles they can touch
+        for (int corner = 0; corner < 4; corner++) {
+            int cx = enemy.x + (corner & 1) * (TILE_SIZE - 1);
+            int cy = enemy.y + (corner >> 1) * (TILE_SIZE - 1);
+            taken[map.tileIndex(cx, cy, TILE_SIZE)] = 1;
+        }
+    }
+    for (const auto& player : game.players.rect) taken[map.tileIndex(player.x, player.y, TILE_SIZE)] = 1;
+
+    vector<int> freeTiles;
+    for (int row = 1; row < map.height - 1; row++) {
+        for (int col = 1; col < map.width - 1; col++) {
+            if (!taken[row * map.width + col]) freeTiles.push_back(row * map.width + col);
+        }
+    }
+    game.bullets.clear();
+    game.bullets.reserve(count);
+    const int inset = (TILE_SIZE - BULLET_SIZE) / 2;
+    for (int i = 0; i < count && !freeTiles.empty(); i++) {
+        int cell = freeTiles[rand() % freeTiles.size()];
+        game.bullets.spawn((cell % map.width) * TILE_SIZE + inset, (cell / map.width) * TILE_SIZE + inset,
+                           0, 0, i % 2 ? TEAM_ENEMY : TEAM_PLAYER);
+    }
+}
+
+volatile int benchSink;
+
+void benchBulletMove(MicroBench& bench, int count) {
+    MapSize map(200, 200);
+    BulletStore store;
+    store.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const int* dir = DIRECTIONS[rand() % 4];
+        store.spawn(map.pixelWidth() / 4 + rand() % (map.pixelWidth() / 2),
+                    map.pixelHeight() / 4 + rand() % (map.pixelHeight() / 2), dir[0], dir[1], TEAM_PLAYER);
+    }
+    vector<int> startX = store.x, startY = store.y;
+    // 16 steps stay well inside the map, then bullets go back to where they started
+    const int steps = 16;
+    bench.run("bullet_move", count, (long long)count * steps, [&]() {
+        for (int s = 0; s < steps; s++) store.move(map);
+        store.x = startX;
+        store.y = startY;
+    });
+}
+
+// Both tank types gate movement on canOccupy; probes are clear so each scans every wall
+void benchTankWallScan(MicroBench& bench, int count) {
+    int side = (int)sqrt((double)count / 0.15) + 4;
+    MapSize map(side, side);
+    WallStore walls;
+    walls.reserve(count);
+    for (int i = 0; i < count; i++) {
+        walls.add((rand() % (side - 2) + 1) * TILE_SIZE, (rand() % (side - 2) + 1) * TILE_SIZE);
+    }
+    vector<SDL_Rect> probes;
+    for (int tries = 0; tries < 100000 && probes.size() < 256; tries++) {
+        SDL_Rect r = {TILE_SIZE + rand() % ((side - 3) * TILE_SIZE), TILE_SIZE + rand() % ((side - 3) * TILE_SIZE),
+                      TILE_SIZE, TILE_SIZE};
+        if (canOccupy(r, walls, map)) probes.push_back(r);
+    }
+    if (probes.empty()) return;
+    bench.run("tank_wall_scan", count, (long long)probes.size(), [&]() {
+        int clear = 0;
+        for (const auto& r : probes) clear += canOccupy(r, walls, map);
+        benchSink = clear;
+    });
+
+    // A player that can shuffle left and right, a full scan on every step
+    for (const auto& r : probes) {
+        SDL_Rect left = {r.x - 5, r.y, TILE_SIZE, TILE_SIZE};
+        if (!canOccupy(left, walls, map)) continue;
+        TankStore players;
+        players.add(r.x, r.y, -1);
+        bench.run("player_move", count, 2, [&]() {
+            players.move(0, -5, 0, walls, map);
+            players.move(0, 5, 0, walls, map);
+        });
+        break;
+    }
+}
+
+void benchCollisions(MicroBench& bench, int count) {
+    Game game(benchOptions(count, 6));
+    if (!game.running) return;
+    spawnHarmlessBullets(game, count);
+    bench.run("update_collisions", count, count, [&]() {
+        game.resolveCollisions();
+        game.arena.reset();
+    });
+}
+
+void benchSpawnEnemies(MicroBench& bench, int count) {
+    Game game(benchOptions(count, 6));
+    if (!game.running) return;
+    bench.run("spawn_enemies", count, count, [&]() {
+        game.spawnEnemies();
+        game.arena.reset();
+    });
+}
+
+// Refill, retire every third bullet, compact: the refill is part of the measured loop
+void benchBulletCompact(MicroBench& bench, int count) {
+    BulletStore store;
+    store.reserve(count);
+    bench.run("bullet_compact", count, count, [&]() {
+        store.clear();
+        for (int i = 0; i < count; i++) store.spawn(i, i, 1, 0, TEAM_ENEMY);
+        for (int i = 0; i < count; i += 3) store.active[i] = 0;
+        store.compact();
+    });
+}
+
+// Draw submission only: the frame is built into the offscreen renderer but never presented
+void benchRender(MicroBench& bench, int count) {
+    Game game(benchOptions(count, 6));
+    if (!game.running) return;
+    spawnHarmlessBullets(game, count);
+    bench.run("render", count, 1, [&]() {
+        game.draw();
+        game.arena.reset();
+    });
+}
+
+// Cost of undoing and replaying ROLLBACK_WINDOW ticks, as a misprediction
+// at the edge of the window would; also checks the replay lands on the same state
+void benchRollback(MicroBench& bench, int count) {
+    GameOptions options = benchOptions(count, 6);
+    options.playerCount = 2;
+    options.frameSkip = INT_MAX / 2;
+    Game game(options);
+    if (!game.running) return;
+    for (int t = 0; t < 30; t++) game.update();
+    const int depth = PeerSession::ROLLBACK_WINDOW;
+    GameState saved;
+    game.saveState(saved);
+    for (int t = 0; t < depth; t++) game.update();
+    Snapshot forward, replayed;
+    vector<Uint32> acks;
+    forward.capture(game, 0, acks);
+
+    GameState scratch;
+    bench.run("rollback_save", count, 1, [&]() {
+        game.saveState(scratch);
+    });
+    bench.run("rollback_resim", count, 1, [&]() {
+        game.loadState(saved);
+        for (int t = 0; t < depth; t++) {
+            game.saveState(scratch);
+            game.update();
+        }
+    });
+    replayed.capture(game, 0, acks);
+    if (!sameSnapshot(forward, replayed)) cerr << "rollback_resim [" << count << "]: replay diverged" << endl;
+}
+
+// Desync hashing against the tick it rides on; peers hash every hashInterval ticks
+void benchStateHash(MicroBench& bench, int count) {
+    GameOptions options = benchOptions(count, 6);
+    options.frameSkip = INT_MAX / 2;
+    Game game(options);
+    if (!game.running) return;
+    for (int t = 0; t < 30; t++) game.update();
+    StateHash hash;
+    bench.run("state_hash", count, count, [&]() {
+        game.hashState(hash);
+    });
+    bench.run("state_hash_tick", count, 1, [&]() {
+        game.update();
+    });
+}
+
+int runMicroBenchmarks(int argc, char* argv[]) {
+    MicroBench bench;
+    vector<int> counts = {100, 1000, 10000};
+    string outPath;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--counts" && i + 1 < argc) {
+            counts.clear();
+            for (char* token = strtok(argv[++i], ","); token; token = strtok(NULL, ",")) {
+                counts.push_back(max(1, atoi(token)));
+            }
+        } else if (arg == "--min-time-ms" && i + 1 < argc) {
+            bench.minSeconds = atof(argv[++i]) / 1000.0;
+        } else if (arg == "--filter" && i + 1 < argc) {
+            bench.filter = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            outPath = argv[++i];
+        }
+    }
+
+    SDL_Init(0);
+    srand(1);
+    for (int count : counts) {
+        if (bench.selected("bullet_move")) benchBulletMove(bench, count);
+        if (bench.selected("tank_wall_scan") || bench.selected("player_move")) benchTankWallScan(bench, count);
+        if (bench.selected("update_collisions")) benchCollisions(bench, count);
+        if (bench.selected("spawn_enemies")) benchSpawnEnemies(bench, count);
+        if (bench.selected("bullet_compact")) benchBulletCompact(bench, count);
+        if (bench.selected("render")) benchRender(bench, count);
+        if (bench.selected("rollback")) benchRollback(bench, count);
+        if (bench.selected("state_hash")) benchStateHash(bench, count);
+    }
+
+    if (outPath.empty()) {
+        bench.writeJson(cout);
+    } else {
+        ofstream out(outPath.c_str());
+        bench.writeJson(out);
+    }
+    IMG_Quit();
+    SDL_Quit();
+    return 0;
+}
+
+// End-to-end numbers from replaying a trace corpus. Peak RSS is for the whole process.
+struct ReplayStats {
+    double ticksPerSecond;
+    double p50Ms;
+    double p99Ms;
+    double p999Ms;
+    double peakRssMb;
+};
+
+double percentile(const vector<double>& sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[min(index, sorted.size() - 1)];
+}
+
+bool saveBaseline(const string& path, const ReplayStats& stats) {
+    ofstream out(path.c_str());
+    out << "ticks_per_second " << stats.ticksPerSecond << "\n"
+        << "p50_ms " << stats.p50Ms << "\n"
+        << "p99_ms " << stats.p99Ms << "\n"
+        << "p999_ms " << stats.p999Ms << "\n"
+        << "peak_rss_mb " << stats.peakRssMb << "\n";
+    return (bool)out;
+}
+
+bool loadBaseline(const string& path, ReplayStats& stats) {
+    ifstream in(path.c_str());
+    if (!in) return false;
+    string key;
+    double value;
+    while (in >> key >> value) {
+        if (key == "ticks_per_second") stats.ticksPerSecond = value;
+        else if (key == "p50_ms") stats.p50Ms = value;
+        else if (key == "p99_ms") stats.p99Ms = value;
+        else if (key == "p999_ms") stats.p999Ms = value;
+        else if (key == "peak_rss_mb") stats.peakRssMb = value;
+    }
+    return true;
+}
+
+// Flags a metric that moved the wrong way by more than thresholdPct
+bool regressed(const char* name, double baseline, double current, bool higherIsBetter, double thresholdPct,
+               bool gated = true) {
+    if (baseline <= 0) return false;
+    double change = (current - baseline) / baseline * 100.0;
+    bool worse = gated && (higherIsBetter ? change < -thresholdPct : change > thresholdPct);
+    cout << "  " << name << ": " << baseline << " -> " << current << " (" << (change >= 0 ? "+" : "")
+         << change << "%)" << (worse ? "  REGRESSION" : "") << endl;
+    return worse;
+}
+
+// A trace's inputs only mean something on the map they were recorded on
+bool layoutMatches(const string& name, const MatchTrace& match, const Game& game) {
+    if (match.layout == game.layoutHash) return true;
+    cerr << name << " was recorded on a different map layout (" << hex << match.layout << ", this build makes "
+         << game.layoutHash << dec << "); record it again" << endl;
+    return false;
+}
+
+// Snapshot bandwidth over a trace: deltas against the previous tick and against
+// one 100 ms (6 tick) round trip ago, next to the old full-state encoding. Every
+// delta is decoded again and must reproduce the snapshot.
+bool measureSnapshotBytes(const string& name, const MatchTrace& match) {
+    GameOptions options;
+    options.headless = true;
+    options.aiThreads = 1;
+    options.frameSkip = INT_MAX / 2;
+    match.apply(options);
+    Game game(options);
+    if (!game.running || !layoutMatches(name, match, game)) return false;
+    SnapshotHistory history;
+    history.reset(game);
+    PacketWriter packet;
+    vector<Uint32> scratch;
+    vector<Uint32> acks(game.players.size(), 0);
+    Snapshot decoded;
+    const int lags[2] = {1, 6};
+    size_t deltaBytes[2] = {0, 0}, fullBytes = 0, maxBytes = 0, joinBytes = 0;
+    bool intact = true;
+    Uint32 tick = 0;
+    for (size_t i = 0; i < match.ticks.size() && game.running; i++) {
+        for (char action : match.ticks[i]) game.applyAction(action);
+        game.update();
+        tick++;
+        Snapshot& current = history.slot(tick);
+        current.capture(game, tick, acks);
+        fullBytes += fullSnapshotSize(current);
+        for (int l = 0; l < 2; l++) {
+            Uint32 baseTick = tick > (Uint32)lags[l] ? tick - lags[l] : 0;
+            const Snapshot* base = history.find(baseTick);
+            packet.clear();
+            writeDelta(packet, *base, current, scratch);
+            deltaBytes[l] += packet.data.size();
+            // Against tick 0 the client has only the empty map, as when it joins
+            size_t& largest = baseTick == 0 ? joinBytes : maxBytes;
+            largest = max(largest, packet.data.size());
+            PacketReader in(packet.data.data(), packet.size());
+            in.u8();
+            Uint32 readTick = in.varint();
+            in.varint();
+            intact &= readDelta(in, *base, readTick, decoded, scratch) && sameSnapshot(decoded, current);
+        }
+    }
+    double ticks = max(1u, tick);
+    cout << name << ": snapshots " << deltaBytes[0] / ticks << " bytes/tick against the last tick, "
+         << deltaBytes[1] / ticks << " against 6 ticks back (max " << maxBytes << ", " << joinBytes
+         << " on join), full state "
+         << fullBytes / ticks << ", round trip " << (intact ? "exact" : "MISMATCH") << endl;
+    return intact;
+}
+
+// Stats of one pass over the corpus
+ReplayStats replayStats(vector<double>& frameMs, double seconds) {
+    ReplayStats stats;
+    sort(frameMs.begin(), frameMs.end());
+    stats.ticksPerSecond = seconds > 0 ? frameMs.size() / seconds : 0;
+    stats.p50Ms = percentile(frameMs, 0.50);
+    stats.p99Ms = percentile(frameMs, 0.99);
+    stats.p999Ms = percentile(frameMs, 0.999);
+    stats.peakRssMb = peakMemoryBytes() / (1024.0 * 1024.0);
+    return stats;
+}
+
+double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Replays every trace listed in the corpus file (paths relative to it) through the real
+// update() and render() with the offscreen renderer, --repeat passes over the whole
+// corpus. Each metric is the median over passes, so one slow pass can't fail the run.
+// Exits 1 when compared against a baseline and ticks/s, p50, p99 or peak RSS is worse
+// by more than --threshold percent; p999 rests on a dozen ticks per pass and is
+// only reported.
+int runReplayBenchmark(int argc, char* argv[]) {
+    string corpusPath, baselinePath, writeBaselinePath;
+    double thresholdPct = 10;
+    int repeat = 5;
+    bool snapshotBytes = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--replay" && i + 1 < argc) {
+            corpusPath = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (arg == "--write-baseline" && i + 1 < argc) {
+            writeBaselinePath = argv[++i];
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            thresholdPct = atof(argv[++i]);
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = max(1, atoi(argv[++i]));
+        } else if (arg == "--snapshot-bytes") {
+            snapshotBytes = true;
+        }
+    }
+
+    ifstream corpus(corpusPath.c_str());
+    if (!corpus) {
+        cerr << "Failed to open trace corpus " << corpusPath << endl;
+        return 1;
+    }
+    size_t slash = corpusPath.find_last_of("/\\");
+    string corpusDir = slash == string::npos ? "" : corpusPath.substr(0, slash + 1);
+    vector<string> names;
+    vector<MatchTrace> matches;
+    string name;
+    while (corpus >> name) {
+        names.push_back(name);
+        matches.emplace_back();
+        if (!matches.back().load(corpusDir + name)) {
+            cerr << "Failed to load trace " << corpusDir + name << endl;
+            return 1;
+        }
+    }
+
+    SDL_Init(0);
+    if (snapshotBytes) {
+        bool intact = true;
+        for (size_t t = 0; t < matches.size(); t++) intact &= measureSnapshotBytes(names[t], matches[t]);
+        SDL_Quit();
+        return intact ? 0 : 1;
+    }
+
+    vector<ReplayStats> passes;
+    vector<double> frameMs;
+    for (int r = 0; r < repeat; r++) {
+        frameMs.clear();
+        double totalSeconds = 0;
+        for (size_t t = 0; t < matches.size(); t++) {
+            GameOptions options;
+            options.headless = true;
+            options.aiThreads = 1;
+            matches[t].apply(options);
+            Game game(options);
+            if (!game.running || !layoutMatches(names[t], matches[t], game)) return 1;
+            size_t before = frameMs.size();
+            game.runReplay(matches[t], frameMs);
+            double seconds = 0;
+            for (size_t i = before; i < frameMs.size(); i++) seconds += frameMs[i] / 1000.0;
+            totalSeconds += seconds;
+            if (r == 0) {
+                cout << names[t] << ": " << frameMs.size() - before << " ticks, "
+                     << (seconds > 0 ? (frameMs.size() - before) / seconds : 0) << " ticks/s" << endl;
             }
+        }
+        passes.push_back(replayStats(frameMs, totalSeconds));
+    }
+
+    vector<double> values(passes.size());
+    ReplayStats stats;
+    double ReplayStats::*metrics[5] = {&ReplayStats::ticksPerSecond, &ReplayStats::p50Ms, &ReplayStats::p99Ms,
+                                       &ReplayStats::p999Ms, &ReplayStats::peakRssMb};
+    for (auto metric : metrics) {
+        for (size_t r = 0; r < passes.size(); r++) values[r] = passes[r].*metric;
+        stats.*metric = median(values);
+    }
+    cout << "Replay: " << frameMs.size() << " ticks per pass, median of " << passes.size() << " passes: "
+         << stats.ticksPerSecond << " ticks/s, p50 " << stats.p50Ms << " ms, p99 " << stats.p99Ms
+         << " ms, p999 " << stats.p999Ms << " ms, peak RSS " << stats.peakRssMb << " MB" << endl;
+
+    int status = 0;
+    if (!baselinePath.empty()) {
+        ReplayStats baseline = {0, 0, 0, 0, 0};
+        if (!loadBaseline(baselinePath, baseline)) {
+            cerr << "Failed to read baseline " << baselinePath << endl;
+            status = 1;
         } else {
-            // Draw game board
-            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-            for (int i = 1; i < MAP_HEIGHT - 1; i++) {
-                for (int j = 1; j < MAP_WIDTH - 1; j++) {
-                    SDL_Rect tile = {j * TILE_SIZE, i * TILE_SIZE, TILE_SIZE, TILE_SIZE};
-                    SDL_RenderFillRect(renderer, &tile);
+            cout << "Against " << baselinePath << " (threshold " << thresholdPct << "%):" << endl;
+            bool worse = false;
+            worse |= regressed("ticks/s", baseline.ticksPerSecond, stats.ticksPerSecond, true, thresholdPct);
+            worse |= regressed("p50 ms", baseline.p50Ms, stats.p50Ms, false, thresholdPct);
+            worse |= regressed("p99 ms", baseline.p99Ms, stats.p99Ms, false, thresholdPct);
+            regressed("p999 ms (not gated)", baseline.p999Ms, stats.p999Ms, false, thresholdPct, false);
+            worse |= regressed("peak RSS MB", baseline.peakRssMb, stats.peakRssMb, false, thresholdPct);
+            if (worse) status = 1;
+        }
+    }
+    if (!writeBaselinePath.empty() && !saveBaseline(writeBaselinePath, stats)) {
+        cerr << "Failed to write baseline " << writeBaselinePath << endl;
+        status = 1;
+    }
+    IMG_Quit();
+    SDL_Quit();
+    return status;
+}
+#endif
+
+#ifdef BATTLECITY_SERVER
+// Sleeps until one of a shard's sockets is readable or a deadline passes. On
+// Linux that is epoll, with a timerfd for deadlines finer than epoll_wait's
+// milliseconds; elsewhere it falls back to select.
+class SocketPoller {
+public:
+    vector<SocketHandle> sockets;
+#ifdef __linux__
+    int epollFd;
+    int timerFd;
+#endif
+
+    SocketPoller() {
+#ifdef __linux__
+        epollFd = -1;
+        timerFd = -1;
+#endif
+    }
+
+    ~SocketPoller() {
+#ifdef __linux__
+        if (epollFd >= 0) ::close(epollFd);
+        if (timerFd >= 0) ::close(timerFd);
+#endif
+    }
+
+    bool open() {
+#ifdef __linux__
+        epollFd = epoll_create1(0);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (epollFd < 0 || timerFd < 0) return false;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = timerFd;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) == 0;
+#else
+        return true;
+#endif
+    }
+
+    bool add(SocketHandle handle) {
+        sockets.push_back(handle);
+#ifdef __linux__
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = handle;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, handle, &event) == 0;
+#else
+        return true;
+#endif
+    }
+
+    void wait(int timeoutUs) {
+        timeoutUs = max(1, timeoutUs);
+#ifdef __linux__
+        // Re-arming also clears any expiry left over from the last wait
+        itimerspec deadline = {};
+        deadline.it_value.tv_sec = timeoutUs / 1000000;
+        deadline.it_value.tv_nsec = (long)(timeoutUs % 1000000) * 1000;
+        timerfd_settime(timerFd, 0, &deadline, NULL);
+        epoll_event events[8];
+        int ready = epoll_wait(epollFd, events, 8, timeoutUs / 1000 + 10);
+        for (int i = 0; i < ready; i++) {
+            Uint64 expirations;
+            if (events[i].data.fd == timerFd && read(timerFd, &expirations, sizeof(expirations)) < 0) break;
+        }
+#else
+        fd_set readable;
+        FD_ZERO(&readable);
+        SocketHandle highest = 0;
+        for (SocketHandle handle : sockets) {
+            FD_SET(handle, &readable);
+            highest = max(highest, handle);
+        }
+        timeval timeout = {timeoutUs / 1000000, timeoutUs % 1000000};
+        select((int)highest + 1, &readable, NULL, NULL, &timeout);
+#endif
+    }
+};
+
+// Counters a shard publishes for the stats file; written by the shard, read by main
+struct ShardStats {
+    atomic<int> matches;
+    atomic<int> players;
+    atomic<Uint64> ticks;
+    atomic<Uint64> overruns;
+    atomic<Uint64> bytesIn;
+    atomic<Uint64> bytesOut;
+    // Performance-counter time spent receiving and stepping matches
+    atomic<Uint64> busy;
+
+    ShardStats() : matches(0), players(0), ticks(0), overruns(0), bytesIn(0), bytesOut(0), busy(0) {}
+};
+
+// One thread's worth of matches sharing one socket. Each match keeps its own
+// tick deadline; deadlines are staggered across the tick period so hundreds of
+// matches don't all step at the same instant. A tick that starts a full period
+// late is an overrun and the match skips ahead instead of catching up.
+class MatchShard {
+public:
+    struct Match {
+        NetServer* server;
+        Uint64 deadline;
+        // Offset of this match's ticks within the period
+        Uint64 phase;
+        // Ticks since the last client left, once anybody has joined
+        int emptyTicks;
+        bool hadClients;
+        int endTicks;
+        size_t bytesCounted;
+    };
+
+    int index;
+    UdpSocket socket;
+    SocketPoller poller;
+    vector<Match> matches;
+    // addressKey of every client seen joining, to its index in matches
+    unordered_map<Uint64, size_t> routes;
+    GameOptions options;
+    int tickRate;
+    // Empty matches kept ready, and the most this shard will host
+    int warmMatches;
+    int maxMatches;
+    Uint32 created;
+    ShardStats stats;
+    vector<Uint8> buffer;
+    PacketWriter packet;
+    Uint64 period;
+
+    MatchShard() {
+        index = 0;
+        tickRate = 60;
+        warmMatches = 0;
+        maxMatches = 64;
+        created = 0;
+        period = 0;
+        buffer.resize(65536);
+    }
+
+    ~MatchShard() {
+        for (auto& match : matches) delete match.server;
+    }
+
+    bool start(Uint16 port, bool sharePort) {
+        if (!socket.open(port, sharePort)) {
+            cerr << "Shard " << index << ": failed to open UDP port " << port << endl;
+            return false;
+        }
+        if (!poller.open() || !poller.add(socket.handle)) {
+            cerr << "Shard " << index << ": failed to set up polling" << endl;
+            return false;
+        }
+        period = SDL_GetPerformanceFrequency() / tickRate;
+        while ((int)matches.size() < warmMatches) {
+            if (!openMatch()) return false;
+        }
+        return true;
+    }
+
+    Match* openMatch() {
+        if ((int)matches.size() >= maxMatches) return NULL;
+        GameOptions matchOptions = options;
+        // Every match gets its own map
+        matchOptions.seed = options.seed + (Uint32)index * 1000003u + created;
+        NetServer* server = new NetServer();
+        server->tickRate = tickRate;
+        if (!server->host(&socket, matchOptions)) {
+            delete server;
+            return NULL;
+        }
+        // Golden-ratio phases spread any number of matches evenly over the period
+        Uint64 phase = (Uint64)(fmod(created * 0.6180339887, 1.0) * period);
+        created++;
+        Match match = {server, SDL_GetPerformanceCounter() + phase, phase, 0, false, 0, 0};
+        matches.push_back(match);
+        return &matches.back();
+    }
+
+    // Known clients go to their match; a join goes to the first match with room
+    void dispatch(const sockaddr_in& from, const Uint8* data, int size) {
+        stats.bytesIn += size;
+        Match* target = NULL;
+        Uint64 key = addressKey(from);
+        auto route = routes.find(key);
+        if (route != routes.end()) {
+            Match& match = matches[route->second];
+            // Clients that left or timed out keep their entry until they're heard from again
+            if (match.server->hasClient(from)) {
+                target = &match;
+            } else {
+                routes.erase(route);
+                route = routes.end();
+            }
+        }
+        if (!target && size > 0 && data[0] == NET_JOIN) {
+            for (auto& match : matches) {
+                NetServer& server = *match.server;
+                if (server.game->running && server.connectedCount() < (int)server.clients.size()) {
+                    target = &match;
+                    break;
+                }
+            }
+            if (!target) target = openMatch();
+            if (!target) {
+                packet.clear();
+                packet.u8(NET_FULL);
+                if (socket.send(from, packet.data)) stats.bytesOut += packet.data.size();
+                return;
+            }
+        }
+        if (!target) return;
+        target->server->handle(from, data, size);
+        if (route == routes.end() && target->server->hasClient(from)) {
+            routes[key] = (size_t)(target - matches.data());
+        }
+        account(*target);
+    }
+
+    void account(Match& match) {
+        stats.bytesOut += match.server->bytesSent - match.bytesCounted;
+        match.bytesCounted = match.server->bytesSent;
+    }
+
+    // Steps every match whose deadline has passed; returns the next deadline
+    Uint64 stepDue() {
+        Uint64 next = ULLONG_MAX;
+        int players = 0;
+        for (size_t m = 0; m < matches.size();) {
+            Match& match = matches[m];
+            NetServer& server = *match.server;
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (now >= match.deadline) {
+                server.step();
+                account(match);
+                stats.ticks++;
+                if (now >= match.deadline + period) {
+                    stats.overruns++;
+                    match.deadline = now + period;
+                } else {
+                    match.deadline += period;
+                }
+                int connected = server.connectedCount();
+                if (connected) match.hadClients = true;
+                match.emptyTicks = connected || !match.hadClients ? 0 : match.emptyTicks + 1;
+                if (!server.game->running) match.endTicks++;
+            }
+            // Finished matches linger a few seconds so clients see the ending
+            if (match.endTicks > tickRate * 3 || match.emptyTicks > tickRate * 10) {
+                // Forget this match's clients and follow the one moving into its place
+                size_t last = matches.size() - 1;
+                for (auto route = routes.begin(); route != routes.end();) {
+                    if (route->second == m) {
+                        route = routes.erase(route);
+                        continue;
+                    }
+                    if (route->second == last) route->second = m;
+                    ++route;
                 }
+                delete match.server;
+                matches[m] = matches.back();
+                matches.pop_back();
+                continue;
             }
+            players += server.connectedCount();
+            next = min(next, match.deadline);
+            m++;
+        }
+        while ((int)matches.size() < warmMatches && openMatch()) {
+            next = min(next, matches.back().deadline);
+        }
+        stats.matches = (int)matches.size();
+        stats.players = players;
+        return next;
+    }
 
-            // Draw walls
-            for (auto& wall : walls) {
-                wall.render(renderer, wallTexture);
+    void run(const atomic<bool>* stop) {
+        double freq = (double)SDL_GetPerformanceFrequency();
+        // Warm matches were set up before the loop started; don't count that as lateness
+        Uint64 begin = SDL_GetPerformanceCounter();
+        for (auto& match : matches) match.deadline = begin + match.phase;
+        while (!*stop) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            sockaddr_in from;
+            int size;
+            while ((size = socket.receive(from, buffer.data(), (int)buffer.size())) > 0) {
+                dispatch(from, buffer.data(), size);
+            }
+            Uint64 next = stepDue();
+            Uint64 now = SDL_GetPerformanceCounter();
+            stats.busy += now - start;
+            if (next > now) {
+                // Wake up at least every 100 ms to notice stop
+                poller.wait((int)min((next - now) * 1e6 / freq, 100000.0));
             }
+        }
+    }
+};
+
+atomic<bool> serverStopping(false);
+
+void stopServer(int) {
+    serverStopping = true;
+}
+
+#ifdef __linux__
+void pinToCore(thread& worker, int core) {
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    pthread_setaffinity_np(worker.native_handle(), sizeof(cores), &cores);
+}
+#endif
+
+// Totals since the last write; rates are per second over that interval
+void writeServerStats(const string& path, const vector<MatchShard*>& shards, vector<Uint64>& last, double seconds,
+                      double freq) {
+    string temporary = path + ".tmp";
+    ofstream out(temporary.c_str());
+    int matches = 0, players = 0;
+    Uint64 ticks = 0, overruns = 0, bytesIn = 0, bytesOut = 0;
+    for (const MatchShard* shard : shards) {
+        matches += shard->stats.matches;
+        players += shard->stats.players;
+        overruns += shard->stats.overruns;
+    }
+    out << "{\n  \"shards\": [\n";
+    for (size_t s = 0; s < shards.size(); s++) {
+        const ShardStats& stats = shards[s]->stats;
+        Uint64 now[4] = {stats.ticks, stats.bytesIn, stats.bytesOut, stats.busy};
+        Uint64* before = &last[s * 4];
+        ticks += now[0] - before[0];
+        bytesIn += now[1] - before[1];
+        bytesOut += now[2] - before[2];
+        out << "    {\"matches\": " << stats.matches << ", \"players\": " << stats.players
+            << ", \"ticks_per_second\": " << (now[0] - before[0]) / seconds << ", \"tick_overruns\": " << stats.overruns
+            << ", \"busy\": " << (now[3] - before[3]) / freq / seconds << "}" << (s + 1 < shards.size() ? "," : "")
+            << "\n";
+        for (int i = 0; i < 4; i++) before[i] = now[i];
+    }
+    out << "  ],\n  \"matches\": " << matches << ",\n  \"players\": " << players << ",\n  \"ticks_per_second\": "
+        << ticks / seconds << ",\n  \"tick_overruns\": " << overruns << ",\n  \"bytes_in_per_second\": "
+        << bytesIn / seconds << ",\n  \"bytes_out_per_second\": " << bytesOut / seconds << "\n}\n";
+    out.close();
+    // Readers never see a half-written file
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    rename(temporary.c_str(), path.c_str());
+}
+
+// The Server target: hosts many matches with no window, renderer or audio.
+// Matches are sharded over one thread per core. Where the platform allows,
+// every shard binds the same port and the kernel spreads clients across them;
+// otherwise shard i listens on port + i.
+int runDedicatedServer(int argc, char* argv[]) {
+    GameOptions options;
+    options.simulationOnly = true;
+    // Shards are the parallelism; per-match AI threads would only oversubscribe
+    options.aiThreads = 1;
+    options.playerCount = 8;
+    int port = NET_DEFAULT_PORT;
+    int shardCount = max(1, (int)thread::hardware_concurrency());
+    int warmMatches = 0;
+    int maxMatches = 512;
+    int tickRate = 60;
+    double durationSeconds = 0;
+    string statsPath = "server-stats.json";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shardCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--matches" && i + 1 < argc) {
+            warmMatches = max(0, atoi(argv[++i]));
+        } else if (arg == "--max-matches" && i + 1 < argc) {
+            maxMatches = max(1, atoi(argv[++i]));
+        } else if (arg == "--tick-rate" && i + 1 < argc) {
+            tickRate = max(1, min(255, atoi(argv[++i])));
+        } else if (arg == "--duration-s" && i + 1 < argc) {
+            durationSeconds = atof(argv[++i]);
+        } else if (arg == "--stats" && i + 1 < argc) {
+            statsPath = argv[++i];
+        } else if (arg == "--players" && i + 1 < argc) {
+            options.playerCount = max(1, min(255, atoi(argv[++i])));
+        } else if (arg == "--map" && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &options.mapWidth, &options.mapHeight);
+            options.mapWidth = max(6, options.mapWidth);
+            options.mapHeight = max(6, options.mapHeight);
+        } else if (arg == "--enemies" && i + 1 < argc) {
+            options.enemyCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--wall-density" && i + 1 < argc) {
+            options.wallThreshold = GameOptions::wallThresholdFor(atof(argv[++i]));
+        } else if (arg == "--fire-cooldown" && i + 1 < argc) {
+            options.enemyFireCooldown = max(1, atoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = (Uint32)strtoul(argv[++i], NULL, 10);
+        }
+    }
+
+    SDL_Init(0);
+#ifdef SO_REUSEPORT
+    bool sharePort = true;
+#else
+    bool sharePort = false;
+#endif
+    vector<MatchShard*> shards;
+    bool ready = true;
+    for (int s = 0; s < shardCount && ready; s++) {
+        MatchShard* shard = new MatchShard();
+        shard->index = s;
+        shard->options = options;
+        shard->tickRate = tickRate;
+        // Spread the totals, rounding up so the warm count is met
+        shard->warmMatches = (warmMatches + shardCount - 1 - s) / shardCount;
+        shard->maxMatches = max(1, (maxMatches + shardCount - 1) / shardCount);
+        shards.push_back(shard);
+        ready = shard->start((Uint16)(sharePort ? port : port + s), sharePort);
+    }
 
-            // Draw player
-            player.render(renderer);
+    if (ready) {
+        signal(SIGINT, stopServer);
+        signal(SIGTERM, stopServer);
+        vector<thread> workers;
+        for (MatchShard* shard : shards) {
+            workers.emplace_back([shard]() { shard->run(&serverStopping); });
+#ifdef __linux__
+            pinToCore(workers.back(), shard->index % max(1, (int)thread::hardware_concurrency()));
+#endif
+        }
+        cout << "Serving " << shardCount << " shards on UDP port " << port
+             << (sharePort || shardCount == 1 ? "" : " and up") << ", " << options.playerCount
+             << " slots per match, stats in " << statsPath << endl;
 
-            // Draw enemies
-            for (auto& enemy : enemies) {
-                if (enemy.active) enemy.render(renderer);
+        double freq = (double)SDL_GetPerformanceFrequency();
+        vector<Uint64> last(shards.size() * 4, 0);
+        Uint64 start = SDL_GetPerformanceCounter();
+        Uint64 lastWrite = start;
+        while (!serverStopping) {
+            SDL_Delay(50);
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (durationSeconds > 0 && (now - start) / freq >= durationSeconds) serverStopping = true;
+            if ((now - lastWrite) / freq >= 1.0 || serverStopping) {
+                writeServerStats(statsPath, shards, last, max((now - lastWrite) / freq, 0.001), freq);
+                lastWrite = now;
             }
         }
+        for (auto& worker : workers) worker.join();
 
-        SDL_RenderPresent(renderer);
+        Uint64 ticks = 0, overruns = 0, bytesIn = 0, bytesOut = 0;
+        for (const MatchShard* shard : shards) {
+            ticks += shard->stats.ticks;
+            overruns += shard->stats.overruns;
+            bytesIn += shard->stats.bytesIn;
+            bytesOut += shard->stats.bytesOut;
+        }
+        double seconds = (SDL_GetPerformanceCounter() - start) / freq;
+        cout << "Server: " << ticks << " match ticks in " << seconds << " s (" << ticks / seconds << "/s), "
+             << overruns << " overruns, " << bytesIn << " bytes in, " << bytesOut << " bytes out" << endl;
     }
+    for (MatchShard* shard : shards) delete shard;
+    SDL_Quit();
+    return ready ? 0 : 1;
+}
+#endif
 
-    void run() {
-        while (running) {
-            handleEvents();
-            update();
-            render();
-            SDL_Delay(16);
+#ifdef BATTLECITY_SERVER
+int main(int argc, char* argv[]) {
+    return runDedicatedServer(argc, argv);
+}
+#else
+int main(int argc, char* argv[]) {
+#ifdef BATTLECITY_BENCH
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--replay") == 0) return runReplayBenchmark(argc, argv);
+    }
+    return runMicroBenchmarks(argc, argv);
+#endif
+    GameOptions options;
+    int headlessTicks = 3600;
+    bool stress = false;
+    bool stressScale = false;
+    int stressTicks = 600;
+    double budgetMs = 1000.0 / 60;
+    int serverPort = -1;
+    int hostPort = -1;
+    string connectAddress;
+    int netPlayers = 8;
+    int peerSlot = -1;
+    int peerPort = NET_DEFAULT_PORT;
+    vector<string> peerAddresses;
+    bool lockstep = false;
+    int inputDelay = -1;
+    int hashInterval = 8;
+    int interpolationDelayMs = 100;
+    bool predict = true;
+    int proxyPort = -1;
+    string proxyTarget;
+    int latencyMs = 0;
+    int jitterMs = 0;
+    double loss = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--bench-pathing" && i + 1 < argc) {
+            int width = 256, height = 256;
+            sscanf(argv[++i], "%dx%d", &width, &height);
+            benchmarkPathing(width, height, 2000);
+            return 0;
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--capture" && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &options.captureWidth, &options.captureHeight);
+        } else if (arg == "--frame-skip" && i + 1 < argc) {
+            options.frameSkip = atoi(argv[++i]);
+        } else if (arg == "--software-render") {
+            options.softwareRender = true;
+        } else if (arg == "--no-dirty-rects") {
+            options.dirtyRects = false;
+        } else if (arg == "--window" && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &options.windowWidth, &options.windowHeight);
+        } else if (arg == "--fullscreen") {
+            options.fullscreen = true;
+        } else if (arg == "--no-integer-scale") {
+            options.integerScale = false;
+        } else if (arg == "--render-scale" && i + 1 < argc) {
+            options.renderScale = max(0.1, min(1.0, atof(argv[++i])));
+        } else if (arg == "--ai-threads" && i + 1 < argc) {
+            options.aiThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--ai-max-thinks" && i + 1 < argc) {
+            options.aiMaxThinks = max(1, atoi(argv[++i]));
+        } else if (arg == "--ai-budget-us" && i + 1 < argc) {
+            options.aiBudgetUs = atof(argv[++i]);
+        } else if (arg == "--server") {
+            serverPort = i + 1 < argc && isdigit(argv[i + 1][0]) ? atoi(argv[++i]) : NET_DEFAULT_PORT;
+        } else if (arg == "--host") {
+            hostPort = i + 1 < argc && isdigit(argv[i + 1][0]) ? atoi(argv[++i]) : NET_DEFAULT_PORT;
+        } else if (arg == "--connect" && i + 1 < argc) {
+            connectAddress = argv[++i];
+        } else if (arg == "--interp-delay-ms" && i + 1 < argc) {
+            interpolationDelayMs = max(0, atoi(argv[++i]));
+        } else if (arg == "--no-predict") {
+            predict = false;
+        } else if (arg == "--proxy" && i + 1 < argc) {
+            proxyPort = atoi(argv[++i]);
+        } else if (arg == "--proxy-target" && i + 1 < argc) {
+            proxyTarget = argv[++i];
+        } else if (arg == "--latency-ms" && i + 1 < argc) {
+            latencyMs = max(0, atoi(argv[++i]));
+        } else if (arg == "--jitter-ms" && i + 1 < argc) {
+            jitterMs = max(0, atoi(argv[++i]));
+        } else if (arg == "--loss" && i + 1 < argc) {
+            loss = max(0.0, min(1.0, atof(argv[++i])));
+        } else if (arg == "--peer-slot" && i + 1 < argc) {
+            peerSlot = atoi(argv[++i]);
+        } else if (arg == "--peer-port" && i + 1 < argc) {
+            peerPort = atoi(argv[++i]);
+        } else if (arg == "--peer" && i + 1 < argc) {
+            peerAddresses.push_back(argv[++i]);
+        } else if (arg == "--lockstep") {
+            lockstep = true;
+        } else if (arg == "--input-delay" && i + 1 < argc) {
+            inputDelay = atoi(argv[++i]);
+        } else if (arg == "--hash-interval" && i + 1 < argc) {
+            hashInterval = max(1, atoi(argv[++i]));
+        } else if (arg == "--players" && i + 1 < argc) {
+            netPlayers = max(1, min(255, atoi(argv[++i])));
+        } else if (arg == "--trace" && i + 1 < argc) {
+            options.tracePath = argv[++i];
+        } else if (arg == "--record" && i + 1 < argc) {
+            options.recordPath = argv[++i];
+        } else if (arg == "--stress") {
+            stress = true;
+        } else if (arg == "--stress-scale") {
+            stress = true;
+            stressScale = true;
+        } else if (arg == "--stress-ticks" && i + 1 < argc) {
+            stressTicks = atoi(argv[++i]);
+        } else if (arg == "--budget-ms" && i + 1 < argc) {
+            budgetMs = atof(argv[++i]);
+        } else if (arg == "--map" && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &options.mapWidth, &options.mapHeight);
+            options.mapWidth = max(6, options.mapWidth);
+            options.mapHeight = max(6, options.mapHeight);
+        } else if (arg == "--enemies" && i + 1 < argc) {
+            options.enemyCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--wall-density" && i + 1 < argc) {
+            options.wallThreshold = GameOptions::wallThresholdFor(atof(argv[++i]));
+        } else if (arg == "--fire-cooldown" && i + 1 < argc) {
+            options.enemyFireCooldown = max(1, atoi(argv[++i]));
+        } else if (arg == "--ticks" && i + 1 < argc) {
+            headlessTicks = atoi(argv[++i]);
+        }
+    }
+
+    if (stress) {
+        options.endless = true;
+        SDL_Init(options.headless ? 0 : SDL_INIT_VIDEO);
+        if (stressScale) {
+            runStressScaling(options, stressTicks, budgetMs);
+        } else {
+            Game game(options);
+            if (game.running) printStress(options, game.runStress(stressTicks));
         }
+        IMG_Quit();
+        SDL_Quit();
+        return 0;
+    }
 
-        // Show end screen for 3 seconds
-        if (isVictory || isGameOver) {
-            Uint32 startTime = SDL_GetTicks();
-            while (SDL_GetTicks() - startTime < 3000) {
-                render();
-                SDL_Delay(16);
+    // Latency and jitter in front of a server, one way each direction; runs until killed
+    if (proxyPort >= 0) {
+        SDL_Init(0);
+        sockaddr_in target;
+        UdpProxy proxy;
+        proxy.latencyMs = latencyMs;
+        proxy.jitterMs = jitterMs;
+        proxy.loss = loss;
+        if (!parseAddress(proxyTarget, target)) {
+            cerr << "Bad proxy target " << proxyTarget << endl;
+        } else if (proxy.start((Uint16)proxyPort, target)) {
+            cout << "Proxying UDP port " << proxyPort << " to " << proxyTarget << " with " << latencyMs << " +- "
+                 << jitterMs << " ms each way" << endl;
+            proxy.run(NULL);
+        }
+        SDL_Quit();
+        return 0;
+    }
+
+    // Dedicated stand-in server: runs until the match is over
+    if (serverPort >= 0) {
+        SDL_Init(0);
+        options.playerCount = netPlayers;
+        NetServer server;
+        if (server.start((Uint16)serverPort, options)) {
+            cout << "Serving " << netPlayers << " player slots on UDP port " << serverPort << endl;
+            server.run(NULL);
+            server.report();
+        }
+        IMG_Quit();
+        SDL_Quit();
+        return 0;
+    }
+
+    // Peer-to-peer rollback or lockstep; peers are listed in slot order, skipping our own slot
+    if (peerSlot >= 0) {
+        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+        vector<sockaddr_in> peers(peerAddresses.size());
+        bool ready = !peers.empty();
+        for (size_t p = 0; p < peers.size(); p++) {
+            if (!parseAddress(peerAddresses[p], peers[p])) {
+                cerr << "Bad peer address " << peerAddresses[p] << endl;
+                ready = false;
             }
         }
+        PeerSession session;
+        session.predictionWindow = lockstep ? 0 : PeerSession::ROLLBACK_WINDOW;
+        session.inputDelay = inputDelay >= 0 ? inputDelay : (lockstep ? 2 : 0);
+        session.hashInterval = hashInterval;
+        if (ready && session.start(options, peerSlot, (Uint16)peerPort, peers)) session.run();
+        IMG_Quit();
+        SDL_Quit();
+        return 0;
     }
 
-    ~Game() {
-        SDL_DestroyTexture(wallTexture);
-        SDL_DestroyTexture(winTexture);
-        SDL_DestroyTexture(gameOverTexture);
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        Mix_FreeChunk(playerShootSound);
-        Mix_FreeChunk(enemyShootSound);
-        Mix_FreeMusic(backgroundMusic);
-        Mix_CloseAudio();
+    // A client, optionally with the server on a thread in this process
+    if (hostPort >= 0 || !connectAddress.empty()) {
+        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+        NetServer server;
+        atomic<bool> stopServer(false);
+        thread serverThread;
+        sockaddr_in address;
+        bool ready = true;
+        if (hostPort >= 0) {
+            options.playerCount = netPlayers;
+            ready = server.start((Uint16)hostPort, options);
+            if (ready) serverThread = thread([&server, &stopServer]() { server.run(&stopServer); });
+            parseAddress("127.0.0.1:" + to_string(hostPort), address);
+        } else if (!parseAddress(connectAddress, address)) {
+            cerr << "Bad server address " << connectAddress << endl;
+            ready = false;
+        }
+        // With a simulated link the client talks to the server through a proxy on this machine
+        UdpProxy proxy;
+        thread proxyThread;
+        if (ready && (latencyMs || jitterMs || loss > 0)) {
+            proxy.latencyMs = latencyMs;
+            proxy.jitterMs = jitterMs;
+            proxy.loss = loss;
+            ready = proxy.start(0, address);
+            if (ready) {
+                proxyThread = thread([&proxy, &stopServer]() { proxy.run(&stopServer); });
+                parseAddress("127.0.0.1:" + to_string(proxy.listener.localPort()), address);
+            }
+        }
+        if (ready) {
+            NetClient client;
+            client.predict = predict;
+            client.interpolationDelayMs = interpolationDelayMs;
+            if (client.connect(address, options)) client.run();
+        }
+        stopServer = true;
+        if (proxyThread.joinable()) proxyThread.join();
+        if (serverThread.joinable()) {
+            serverThread.join();
+            server.report();
+        }
+        IMG_Quit();
+        SDL_Quit();
+        return 0;
+    }
+
+    if (options.headless) {
+        SDL_Init(0);
+        bool ok = true;
+        {
+            Game game(options);
+            if (game.running) ok = game.runHeadless(headlessTicks);
+        }
+        IMG_Quit();
+        SDL_Quit();
+        return ok ? 0 : 1;
     }
-};
 
-int main(int argc, char* argv[]) {
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
     IMG_Init(IMG_INIT_PNG);
     Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
@@ -509,7 +6184,7 @@ int main(int argc, char* argv[]) {
     SDL_DestroyRenderer(menuRenderer);
     SDL_DestroyWindow(menuWindow);
 
-    Game game;
+    Game game(options);
     game.run();
 
     Mix_CloseAudio();
@@ -517,3 +6192,4 @@ int main(int argc, char* argv[]) {
     SDL_Quit();
     return 0;
 }
+#endif